@@ -0,0 +1,270 @@
+/*
+ * Adapter class and service record, set up by a thread of its own,
+ * so that a slow or missing adapter never holds the input up
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "btkbdd.h"
+
+/* Peripheral, keyboard */
+#define KEYBOARD_CLASS		0x002540UL
+
+/* The major and minor device class. The service class bits above them
+ * are bluetoothd's and the controller's to add as they see fit. */
+#define DEVICE_CLASS_MASK	0x001ffcUL
+
+/* How long to wait before trying again, in milliseconds. Doubled
+ * with each failure, up to the maximum. */
+#define BACKOFF_MIN		1000
+#define BACKOFF_MAX		30000
+
+static struct {
+	bdaddr_t src;
+	int dev;		/* HCI device, -1 if not found yet */
+	uint32_t save_class;	/* Class to restore when we're done */
+	int classed;		/* We're a keyboard */
+	int sdp;		/* Service record registered */
+	int ready;		/* All of the above */
+	int kick;		/* Check if it's all still in place */
+	int quit;
+	int wake;		/* eventfd the thread waits on */
+	int notify;		/* eventfd telling the loop the readiness changed */
+	pthread_t thread;
+} adapter = {
+	.dev = -1,
+	.ready = 1,		/* Unless there's an adapter to wait for */
+	.wake = -1,
+	.notify = -1,
+};
+
+static void
+adapter_signal (fd)
+	int fd;
+{
+	uint64_t one = 1;
+
+	if (write (fd, &one, sizeof(one)) != sizeof(one))
+		perror ("Could not signal the adapter status");
+}
+
+static void
+adapter_set_ready (ready)
+	int ready;
+{
+	if (adapter.ready == ready)
+		return;
+	__atomic_store_n (&adapter.ready, ready, __ATOMIC_RELEASE);
+	GAUGE(adapter, ready);
+	adapter_signal (adapter.notify);
+}
+
+/* Make the adapter look like a keyboard. Returns 0 once it's done,
+ * -1 if it's worth trying again later. */
+static int
+adapter_setup ()
+{
+	uint32_t class;
+
+	if (adapter.dev == -1) {
+		if (bacmp (&adapter.src, BDADDR_ANY)) {
+			char addr[18];
+
+			ba2str (&adapter.src, addr);
+			adapter.dev = hci_devid (addr);
+			/* Not yet plugged in or visited by udev? */
+			if (adapter.dev == -1) {
+				perror ("Can not initialize HCI device");
+				return -1;
+			}
+		} else {
+			/* No source device specified. Assume first. */
+			adapter.dev = 0;
+		}
+	}
+
+	if (!adapter.classed) {
+		class = set_class (adapter.dev, KEYBOARD_CLASS);
+		if (!class) {
+			/* Perhaps it's a different device by now */
+			adapter.dev = -1;
+			return -1;
+		}
+		/* The class it had before we came, not after a replug */
+		if (!adapter.save_class)
+			adapter.save_class = class;
+		adapter.classed = 1;
+	}
+
+	if (!adapter.sdp) {
+		if (sdp_open () == -1) {
+			perror ("Can not connect to the SDP server");
+			return -1;
+		}
+		if (sdp_add_keyboard () == -1) {
+			sdp_remove ();
+			return -1;
+		}
+		adapter.sdp = 1;
+	}
+
+	return 0;
+}
+
+/* Is the adapter still there and still a keyboard? If it was reset
+ * or replugged, set up whatever was lost. */
+static int
+adapter_check ()
+{
+	uint32_t class;
+
+	class = get_class (adapter.dev);
+	if (class && (class & DEVICE_CLASS_MASK) == (KEYBOARD_CLASS & DEVICE_CLASS_MASK))
+		return 0;
+
+	/* If the adapter went away, the SDP server likely did as well */
+	adapter.classed = 0;
+	adapter.sdp = 0;
+	sdp_remove ();
+	if (!class)
+		adapter.dev = -1;
+
+	return -1;
+}
+
+static void *
+adapter_thread (data)
+	void *data;
+{
+	struct pollfd pfd = { .fd = adapter.wake, .events = POLLIN };
+	int backoff = BACKOFF_MIN;
+	long long next = 0;
+	int timeout;
+	uint64_t n;
+
+	while (!__atomic_load_n (&adapter.quit, __ATOMIC_ACQUIRE)) {
+		if (adapter.ready)
+			timeout = -1;
+		else
+			timeout = next > now () ? next - now () : 0;
+		if (poll (&pfd, 1, timeout) == 1
+			&& read (adapter.wake, &n, sizeof(n)) == -1)
+			perror ("Could not read the adapter thread eventfd");
+
+		if (__atomic_exchange_n (&adapter.kick, 0, __ATOMIC_ACQUIRE)
+			&& adapter.ready && adapter_check () == -1) {
+			adapter_set_ready (0);
+			next = 0;
+			backoff = BACKOFF_MIN;
+		}
+		if (adapter.ready || now () < next)
+			continue;
+
+		if (adapter_setup () == 0) {
+			adapter_set_ready (1);
+			backoff = BACKOFF_MIN;
+		} else {
+			COUNT(adapter_failures, 1);
+			next = now () + backoff;
+			backoff = backoff * 2 > BACKOFF_MAX ? BACKOFF_MAX : backoff * 2;
+		}
+	}
+
+	return NULL;
+}
+
+/* Start setting up given adapter. Returns a descriptor that becomes
+ * readable when the adapter becomes ready or stops being so. */
+int
+adapter_start (src)
+	const bdaddr_t *src;
+{
+	int ret;
+
+	bacpy (&adapter.src, src);
+	adapter.ready = 0;
+	GAUGE(adapter, 0);
+
+	adapter.wake = eventfd (0, EFD_CLOEXEC);
+	adapter.notify = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (adapter.wake == -1 || adapter.notify == -1) {
+		perror ("Could not create an eventfd");
+		goto fail;
+	}
+
+	ret = pthread_create (&adapter.thread, NULL, adapter_thread, NULL);
+	if (ret) {
+		fprintf (stderr, "Could not start the adapter thread: %s\n", strerror (ret));
+		goto fail;
+	}
+
+	return adapter.notify;
+fail:
+	if (adapter.wake != -1)
+		close (adapter.wake);
+	if (adapter.notify != -1)
+		close (adapter.notify);
+	adapter.wake = adapter.notify = -1;
+	return -1;
+}
+
+/* Take note of the readiness change. Returns whether it's ready. */
+int
+adapter_ack ()
+{
+	uint64_t n;
+
+	if (adapter.notify != -1 && read (adapter.notify, &n, sizeof(n)) == -1
+		&& errno != EAGAIN)
+		perror ("Could not read the adapter status");
+	return adapter_ready ();
+}
+
+int
+adapter_ready ()
+{
+	return __atomic_load_n (&adapter.ready, __ATOMIC_ACQUIRE);
+}
+
+/* Something went wrong, perhaps with the adapter. Have it checked. */
+void
+adapter_kick ()
+{
+	if (adapter.wake == -1)
+		return;
+	__atomic_store_n (&adapter.kick, 1, __ATOMIC_RELEASE);
+	adapter_signal (adapter.wake);
+}
+
+/* Stop the thread and leave the adapter the way we found it */
+void
+adapter_stop ()
+{
+	if (adapter.wake == -1)
+		return;
+
+	__atomic_store_n (&adapter.quit, 1, __ATOMIC_RELEASE);
+	adapter_signal (adapter.wake);
+	pthread_join (adapter.thread, NULL);
+
+	sdp_remove ();
+	if (adapter.save_class && adapter.dev != -1)
+		set_class (adapter.dev, adapter.save_class);
+
+	close (adapter.wake);
+	close (adapter.notify);
+	adapter.wake = adapter.notify = -1;
+}
@@ -2,4 +2,4 @@
 // We should really use the boot one instead...
 
 char ReportDescriptor[] = {
-0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x85, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x75, 0x08, 0x95, 0x01, 0x81, 0x01, 0x75, 0x01, 0x95, 0x05, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x75, 0x03, 0x95, 0x01, 0x91, 0x01, 0x75, 0x08, 0x95, 0x06, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x05, 0x07, 0x19, 0x00, 0x2A, 0xFF, 0x00, 0x81, 0x00, 0xC0, 0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x47, 0x05, 0x01, 0x09, 0x06, 0xA1, 0x02, 0x05, 0x06, 0x09, 0x20, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, 0x01, 0x81, 0x02, 0xC0, 0xC0, 0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x11, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x03, 0x81, 0x01, 0x75, 0x01, 0x95, 0x01, 0x05, 0x0C, 0x09, 0xB8, 0x81, 0x02, 0x06, 0xFF, 0x00, 0x09, 0x03, 0x81, 0x02, 0x75, 0x01, 0x95, 0x03, 0x81, 0x01, 0x05, 0x0C, 0x85, 0x12, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x01, 0x09, 0xCD, 0x81, 0x02, 0x09, 0xB3, 0x81, 0x02, 0x09, 0xB4, 0x81, 0x02, 0x09, 0xB5, 0x81, 0x02, 0x09, 0xB6, 0x81, 0x02, 0x81, 0x01, 0x81, 0x01, 0x81, 0x01, 0x85, 0x13, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x01, 0x06, 0x01, 0xFF, 0x09, 0x0A, 0x81, 0x02, 0x06, 0x01, 0xFF, 0x09, 0x0C, 0x81, 0x22, 0x75, 0x01, 0x95, 0x06, 0x81, 0x01, 0x85, 0x09, 0x09, 0x0B, 0x75, 0x08, 0x95, 0x01, 0xB1, 0x02, 0x75, 0x08, 0x95, 0x02, 0xB1, 0x01, 0xC0, 0x00};
+0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x85, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x75, 0x08, 0x95, 0x01, 0x81, 0x01, 0x75, 0x01, 0x95, 0x05, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x75, 0x03, 0x95, 0x01, 0x91, 0x01, 0x75, 0x08, 0x95, 0x06, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x05, 0x07, 0x19, 0x00, 0x2A, 0xFF, 0x00, 0x81, 0x00, 0xC0, 0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x47, 0x05, 0x01, 0x09, 0x06, 0xA1, 0x02, 0x05, 0x06, 0x09, 0x20, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, 0x01, 0x81, 0x02, 0xC0, 0xC0, 0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x11, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x03, 0x81, 0x01, 0x75, 0x01, 0x95, 0x01, 0x05, 0x0C, 0x09, 0xB8, 0x81, 0x02, 0x06, 0xFF, 0x00, 0x09, 0x03, 0x81, 0x02, 0x75, 0x01, 0x95, 0x03, 0x81, 0x01, 0x05, 0x0C, 0x85, 0x12, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x01, 0x09, 0xCD, 0x81, 0x02, 0x09, 0xB3, 0x81, 0x02, 0x09, 0xB4, 0x81, 0x02, 0x09, 0xB5, 0x81, 0x02, 0x09, 0xB6, 0x81, 0x02, 0x09, 0x6F, 0x81, 0x02, 0x09, 0x70, 0x81, 0x02, 0x81, 0x01, 0x85, 0x13, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x01, 0x06, 0x01, 0xFF, 0x09, 0x0A, 0x81, 0x02, 0x06, 0x01, 0xFF, 0x09, 0x0C, 0x81, 0x22, 0x75, 0x01, 0x95, 0x06, 0x81, 0x01, 0x85, 0x09, 0x09, 0x0B, 0x75, 0x08, 0x95, 0x01, 0xB1, 0x02, 0x75, 0x08, 0x95, 0x02, 0xB1, 0x01, 0xC0, 0x00};
@@ -9,6 +9,7 @@
  */
 
 #include <stdint.h>
+#include <stdio.h>
 #include <bluetooth/bluetooth.h>
 
 #ifndef __BTKBDD_H
@@ -21,15 +22,170 @@
 #define DBG(...)
 #endif
 
+/* How do we talk to hosts */
+struct transport {
+	const char *name;
+	int (*listen) (const bdaddr_t *, unsigned short, int, int);
+	int (*accept) (int, bdaddr_t *);
+	int (*connect) (bdaddr_t *, bdaddr_t *, unsigned short);
+	int (*connected) (int);
+	int adapter;		/* Needs the HCI and SDP set up */
+};
+
+extern struct transport l2cap_transport;
+extern struct transport local_transport;
+
+/* Hosts to be connected at once. Can be changed at build time, with
+ * -DHOSTS=n in CFLAGS, up to as many as there are number keys to pick
+ * them with. */
+#ifndef HOSTS
+#define HOSTS			4
+#endif
+#if HOSTS < 1 || HOSTS > 9
+#error "HOSTS must be between 1 and 9"
+#endif
+
+/* Settings from the command line */
+struct config {
+	int frames;		/* One report per input frame */
+	int backlog;		/* Keep unsent reports for so many ms */
+	char *metrics;		/* Write counters to this file */
+	int nkro;		/* Offer the N-key rollover report */
+	int uhid;		/* Feed the reports to a local uhid device too */
+	char *record;		/* Record the input events into this file */
+	struct transport *transport;
+	int realtime;		/* Input handled by a thread of its own */
+	int priority;		/* SCHED_FIFO priority of that thread */
+	char *cpus;		/* Processors it runs on */
+	char *watch;		/* Add keyboards that appear in this directory */
+	int hotkey;		/* Key that switches between the hosts */
+	int broadcast;		/* All hosts get the key presses */
+};
+
+extern struct config config;
+
+/* Protocol peculiarities of a host */
+struct quirks {
+	const char *name;
+	int handshake;		/* Send the Apple handshake */
+	int delay;		/* Hold reports back after connecting, in ms */
+	int boot;		/* Send the boot protocol keyboard report only */
+	int leds;		/* How are LED reports parsed */
+	int nkro;		/* Understands the N-key rollover report */
+};
+
+#define QUIRK_LEDS_STRICT	0	/* Only well-formed output reports */
+#define QUIRK_LEDS_ANY		1	/* Anything that ends with the LEDs */
+
+/* Something the event loop watches */
+struct source {
+	int fd;
+	uint32_t events;
+	void (*handler) (struct source *, uint32_t);
+	void *data;
+};
+
+long long now ();
+long long now_us ();
+int ev_init ();
+void ev_done ();
+int ev_set (struct source *, int, uint32_t);
+void ev_quit ();
+void ev_run (void (*) (void *), void *);
+int timer_open ();
+int timer_set (int, long long);
+void timer_ack (int);
+int signals_open ();
+int signals_read (int);
+
+/* Latency measurement stages, from the kernel event timestamp */
+#define LAT_READ	0	/* Read from the event device */
+#define LAT_REPORT	1	/* Report built */
+#define LAT_SENT	2	/* Report written to the host */
+#define LAT_STAGES	3
+
+/* Things worth counting. Cheap to update from anywhere. They're written
+ * out by another thread than the one updating them, so all accesses are
+ * atomic, relaxed ones; the dirty flag orders them. */
+struct counters {
+	uint64_t events;		/* Input events read */
+	uint64_t reports;		/* Reports built */
+	uint64_t sent;			/* Reports sent to host */
+	uint64_t bytes;			/* Bytes sent to host */
+	uint64_t dropped;		/* Reports not delivered */
+	uint64_t handshakes[16];	/* Handshakes sent, by result */
+	uint64_t connects;		/* Outgoing connections attempted */
+	uint64_t connect_failures;
+	uint64_t connected;		/* Outgoing connections estabilished */
+	uint64_t connect_ms;		/* Time they took */
+	uint64_t accepts;		/* Incoming connections */
+	uint64_t switches;		/* Switches to another host */
+	uint64_t rollovers;		/* More than six keys pressed */
+	uint64_t stalls;		/* Interrupt channel not writable */
+	uint64_t stall_ms;		/* For how long */
+	uint64_t collapsed;		/* Reports merged into queued ones */
+	uint64_t adapter_failures;	/* Adapter setup attempts failed */
+	int queued;			/* Reports waiting to be sent */
+	int adapter;			/* Adapter set up */
+	int up;				/* Hosts connected */
+	int dirty;			/* Changed since written out */
+};
+
+extern struct counters counters;
+
+#define COUNT(counter, n) do { \
+	__atomic_fetch_add (&counters.counter, (n), __ATOMIC_RELAXED); \
+	__atomic_store_n (&counters.dirty, 1, __ATOMIC_RELEASE); \
+} while (0)
+
+/* Gauges only ever change on a single thread */
+#define GAUGE(gauge, value) do { \
+	__atomic_store_n (&counters.gauge, (value), __ATOMIC_RELAXED); \
+	__atomic_store_n (&counters.dirty, 1, __ATOMIC_RELEASE); \
+} while (0)
+
+int stats_write (const char *);
+void lat_enable ();
+void lat_record (int, long long);
+void lat_dump (FILE *);
+
 int l2cap_listen (const bdaddr_t *, unsigned short, int, int);
 int l2cap_accept (int, bdaddr_t *);
 int l2cap_connect (bdaddr_t *, bdaddr_t *, unsigned short);
+int l2cap_connected (int);
+
+void local_init (const char *);
 
+int rt_cpus (const char *);
+void rt_lock ();
+void rt_thread ();
+
+int uhid_open (const char *);
+int uhid_input (int, const uint8_t *, int);
+int uhid_read (int);
+void uhid_close (int);
+
+const uint8_t *report_descriptor (int *);
 int sdp_open ();
-void sdp_add_keyboard ();
+int sdp_add_keyboard ();
 void sdp_remove ();
 
+void quirks_load (char *, const struct quirks *);
+const struct quirks *quirks_profile (const char *);
+const struct quirks *quirks_get (const bdaddr_t *);
+const struct quirks *quirks_set (const bdaddr_t *, const struct quirks *);
+int quirks_changed ();
+void quirks_save ();
+
+uint32_t get_class (int);
 uint32_t set_class (int, uint32_t);
-int loop (char *, bdaddr_t, bdaddr_t *);
+
+int adapter_start (const bdaddr_t *);
+int adapter_ack ();
+int adapter_ready ();
+void adapter_kick ();
+void adapter_stop ();
+
+int loop (char **, bdaddr_t, bdaddr_t *);
 
 #endif
@@ -0,0 +1,231 @@
+/*
+ * Event loop
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "btkbdd.h"
+
+#define EV_MAX 16		/* Events handled per wakeup */
+
+static int epfd = -1;
+static int quit = 0;
+
+/* Events of the current wakeup that were not dispatched yet */
+static struct epoll_event ready[EV_MAX];
+static int nready = 0;
+
+/* Milliseconds since an arbitrary point in past */
+long long
+now ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Microseconds on the same clock */
+long long
+now_us ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int
+ev_init ()
+{
+	epfd = epoll_create1 (EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perror ("Could not create the event loop");
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+ev_done ()
+{
+	if (epfd != -1)
+		close (epfd);
+	epfd = -1;
+}
+
+/* Watch given descriptor for events (EPOLLIN, EPOLLOUT) on behalf of
+ * a source. Changing the descriptor replaces the old one, -1 stops
+ * watching. The old descriptor must not be closed before that. */
+int
+ev_set (source, fd, events)
+	struct source *source;
+	int fd;
+	uint32_t events;
+{
+	struct epoll_event ev;
+	int i;
+
+	if (source->fd == fd && source->events == events)
+		return 0;
+
+	if (source->fd != -1 && source->fd != fd) {
+		if (epoll_ctl (epfd, EPOLL_CTL_DEL, source->fd, NULL) == -1)
+			perror ("Could not stop watching a descriptor");
+		/* Don't dispatch what it had pending */
+		for (i = 0; i < nready; i++) {
+			if (ready[i].data.ptr == source)
+				ready[i].data.ptr = NULL;
+		}
+	}
+
+	ev.events = events;
+	ev.data.ptr = source;
+	if (fd != -1 && epoll_ctl (epfd, source->fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == -1) {
+		perror ("Could not watch a descriptor");
+		source->fd = -1;
+		return -1;
+	}
+
+	source->fd = fd;
+	source->events = events;
+	return 0;
+}
+
+/* Make ev_run() return */
+void
+ev_quit ()
+{
+	quit = 1;
+}
+
+/* Dispatch events until ev_quit() is called. The prepare hook runs
+ * before each wait, so that timers can be armed. */
+void
+ev_run (prepare, data)
+	void (*prepare) ();
+	void *data;
+{
+	struct source *source;
+	int i;
+
+	quit = 0;
+	while (!quit) {
+		if (prepare)
+			prepare (data);
+
+		nready = epoll_wait (epfd, ready, EV_MAX, -1);
+		if (nready == -1) {
+			nready = 0;
+			if (errno == EINTR)
+				continue;
+			perror ("Could not wait for events");
+			return;
+		}
+
+		for (i = 0; i < nready && !quit; i++) {
+			source = ready[i].data.ptr;
+			if (source)
+				source->handler (source, ready[i].events);
+		}
+		nready = 0;
+	}
+}
+
+/* A timer that fires on an absolute time from now() */
+int
+timer_open ()
+{
+	int fd;
+
+	fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1)
+		perror ("Could not create a timer");
+
+	return fd;
+}
+
+/* Arm the timer for given time, -1 disarms it */
+int
+timer_set (fd, when)
+	int fd;
+	long long when;
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	if (when != -1) {
+		its.it_value.tv_sec = when / 1000;
+		its.it_value.tv_nsec = when % 1000 * 1000000;
+		/* All zeroes would disarm it */
+		if (when == 0)
+			its.it_value.tv_nsec = 1;
+	}
+
+	if (timerfd_settime (fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		perror ("Could not set a timer");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Acknowledge the timer expiration */
+void
+timer_ack (fd)
+	int fd;
+{
+	uint64_t expirations;
+
+	if (read (fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+		perror ("Could not read the timer");
+}
+
+/* Termination and status dump signals are delivered as events
+ * via a descriptor */
+int
+signals_open ()
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset (&mask);
+	sigaddset (&mask, SIGINT);
+	sigaddset (&mask, SIGTERM);
+	sigaddset (&mask, SIGHUP);
+	sigaddset (&mask, SIGUSR1);
+
+	if (sigprocmask (SIG_BLOCK, &mask, NULL) == -1) {
+		perror ("Could not block signals");
+		return -1;
+	}
+
+	fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd == -1)
+		perror ("Could not create a signal descriptor");
+
+	return fd;
+}
+
+/* Read a signal from the descriptor. Returns its number. */
+int
+signals_read (fd)
+	int fd;
+{
+	struct signalfd_siginfo si;
+
+	if (read (fd, &si, sizeof(si)) != sizeof(si))
+		return 0;
+
+	return si.ssi_signo;
+}
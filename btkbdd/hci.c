@@ -5,10 +5,34 @@
  */
 
 #include <stdint.h>
+#include <unistd.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 
+/* Returns the class of the device, 0 if it can't be read */
+uint32_t
+get_class (dev)
+	int dev;
+{
+	uint8_t class[3];
+
+	dev = hci_open_dev(dev);
+	if (dev == -1) {
+		perror ("Can not open the bluetooth device");
+		return 0;
+	}
+	if (hci_read_class_of_dev(dev, class, 1000) == -1) {
+		perror ("Can not read HCI class");
+		hci_close_dev(dev);
+		return 0;
+	}
+	hci_close_dev(dev);
+
+	return class[0] | class[1] << 8 | class[2] << 16;
+}
+
+/* Returns the class the device had before, 0 on failure */
 uint32_t
 set_class (dev, class)
 	int dev;
@@ -23,12 +47,16 @@ set_class (dev, class)
 	}
 	if (hci_read_class_of_dev(dev, save_class, 1000) == -1) {
 		perror ("Can not read HCI class");
-		return 0;
+		goto fail;
 	}
 	if (hci_write_class_of_dev(dev, class, 1000) == -1 ) {
 		perror ("Can not set HCI class");
-		return 0;
+		goto fail;
 	}
+	hci_close_dev(dev);
 
 	return save_class[0] | save_class[1] << 8 | save_class[2] << 16;
+fail:
+	hci_close_dev(dev);
+	return 0;
 }
@@ -67,4 +67,10 @@
 #define HIDP_RIGHTALT	0x40
 #define HIDP_RIGHTGUI	0x80
 
+/* Reports in our descriptor */
+#define KEY_REPORT_ID		0x01	/* Keyboard, six keys */
+#define NKRO_REPORT_ID		0x02	/* Keyboard, bitmap */
+#define EJECT_REPORT_ID		0x11	/* Eject and Fn */
+#define MEDIA_REPORT_ID		0x12	/* Playback and brightness */
+
 #endif
@@ -6,22 +6,32 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
-#include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <linux/input.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hidp.h>
-#include <bluetooth/hci.h>
-#include <bluetooth/hci_lib.h>
 
 #include "btkbdd.h"
 #include "hid.h"
 #include "linux2hid.h"
+#include "../evreplay/evrec.h"
+#include "../evmuxd/evchan.h"
 
 /* A packet we're sending to host after a keypress */
 struct key_report {
@@ -32,12 +42,134 @@ struct key_report {
 	uint8_t key[6];
 } __attribute__((packed));
 
+/* The same with a bit for each usage, for hosts that can do N-key
+ * rollover. Modifiers are the bits of usages 0xe0 to 0xe7. */
+struct nkro_report {
+	uint8_t type;
+	uint8_t report;
+	uint8_t bits[32];
+} __attribute__((packed));
+
+/* Reported in all slots when more than six keys are pressed */
+#define HID_ERROR_ROLLOVER	0x01
+
+/* Keys being held down */
+struct keys {
+	uint8_t slot[SLOTS];	/* Modifiers and consumer controls */
+	uint8_t count;		/* Keys pressed, without modifiers */
+	uint8_t key[6];		/* First six of them, in order of presses */
+	uint8_t bits[32];	/* All of them */
+};
+
+/* Events read from the event device, but not processed yet.
+ * Many of them are read at once, the kernel fills in as much as fits. */
+#define EVRING_SIZE 64		/* Must be a power of two */
+struct evring {
+	struct input_event event[EVRING_SIZE];
+	unsigned int head;	/* Next event to process */
+	unsigned int tail;	/* Next free slot */
+	long long stamp;	/* When was it last filled, in us */
+};
+
+/* A keyboard we read. There can be several of them, the keys they
+ * hold are merged as if they were a single one. */
+#define INPUTS 16
+struct input {
+	char *path;
+	int fd;			/* event device, -1 if the slot is free */
+	struct evchan chan;	/* ...or evmuxd's channel, if it's mapped */
+	struct evring ring;	/* events read, but not processed */
+	uint32_t down[(KEY_MAX + 1) / 32];	/* Keys it holds */
+	struct source src, chan_src;
+};
+
+/* A keyboard state waiting to be sent to the host */
+struct report {
+	long long time;		/* When did it change */
+	long long stamp;	/* Kernel time of the key event, in us */
+	int slot;		/* Which report is it */
+	struct keys keys;
+};
+
+/* Reports held back until the host is ready to take them.
+ * This survives reconnects, so that keys pressed while the host
+ * was away are not lost. */
+#define QUEUE_SIZE 256		/* Must be a power of two */
+struct queue {
+	struct report report[QUEUE_SIZE];
+	unsigned int head;	/* Next report to send */
+	unsigned int tail;	/* Next free slot */
+};
+
+/* Connection to a host */
+struct host {
+	bdaddr_t addr;
+	const struct quirks *quirks;
+	int control;		/* HIDP control channel */
+	int intr;		/* HIDP interrupt channel */
+	int state;
+	int connecting;		/* Channels still being connected */
+	long long started;	/* When did we start connecting */
+	long long deadline;	/* When do we give up connecting */
+	long long up;		/* When did it come up */
+	long long ready;	/* Hold reports back until then */
+	long long retry;	/* Don't reconnect on our own before this */
+	long long used;		/* When did it last come up or get picked */
+	int protocol;		/* Set by the host, report unless told otherwise */
+	int leds;		/* As the host set them */
+	long long congested;	/* Interrupt channel not writable since */
+	struct keys sent;	/* What the host was told last */
+	struct queue queue;
+	struct source control_src, intr_src;
+};
+
+/* Host connection states */
+#define HOST_DOWN		0
+#define HOST_CONNECTING		1	/* Outgoing connection in progress */
+#define HOST_UP			2
+
+/* Channels for host.connecting */
+#define HOST_CONTROL		0x01
+#define HOST_INTR		0x02
+
+/* How long to wait for a host to answer a page, in milliseconds */
+#define CONNECT_TIMEOUT		10000
+
+/* How long to wait before reconnecting to replay held back reports */
+#define RETRY_DELAY		1000
+
+/* How soon Apple hosts hang up if they're not sent the handshake */
+#define HELLO_TIMEOUT		1000
+
+/* Spacing of replayed reports, in milliseconds */
+#define REPLAY_INTERVAL		10
+
+/* How often are the metrics written out, at most */
+#define METRICS_INTERVAL	1000
+
+/* Work the input thread leaves to the main one, for session.work */
+#define WORK_METRICS		0x01	/* Write the counters out */
+#define WORK_QUIT		0x02	/* Input thread is done */
+#define WORK_QUIRKS		0x04	/* Save the host quirks */
+
 /* Keyboard status (keys pressed and LEDs lit) */
 struct status {
 	uint8_t leds;
-	struct key_report report;
+	struct keys keys;
+	uint32_t frame[(KEY_MAX + 1) / 32];	/* Keys changed since last report */
+	uint8_t held[KEY_MAX + 1];	/* Keyboards holding each key */
+	int changed;			/* Slots with a report not sent yet */
+	long long stamp;		/* Kernel time of the last key event */
+	int hotkey;			/* Host switching hotkey held down */
+	int picked;			/* A host was picked with it */
+	int select;			/* Host to switch to, or SELECT_* */
 };
 
+/* For status.select */
+#define SELECT_NONE		-1
+#define SELECT_NEXT		HOSTS
+#define SELECT_ALL		(HOSTS + 1)
+
 /* Update LEDs.
  * TODO: Only ones that changed -- we already keep global track. */
 static int
@@ -76,16 +208,72 @@ set_leds (input, leds)
 	return 0;
 }
 
+/* Update LEDs of all the keyboards */
+static void
+inputs_leds (inputs, leds)
+	struct input *inputs;
+	uint8_t leds;
+{
+	int i;
+
+	for (i = 0; i < INPUTS; i++) {
+		if (inputs[i].fd != -1 && !inputs[i].chan.ring)
+			set_leds (inputs[i].fd, leds);
+	}
+}
+
+/* Parse the LED state from an output report.
+ * Returns -1 if we don't understand the report. */
+static int
+parse_leds (host, buf, size)
+	struct host *host;
+	uint8_t *buf;
+	int size;
+{
+	/* Apple (iPad) seemingly randomly sends either
+	 * "a2 01 xx" or "a2 xx" when setting LEDs... */
+	if (host->quirks->leds == QUIRK_LEDS_ANY)
+		return size == 3 || size == 2 ? buf[size - 1] : -1;
+
+	if (size == 3 && buf[1] == 0x01)
+		return buf[2];
+
+	/* No report ID where there should be one.
+	 * That's the Apple thing, remember it for next time. */
+	if (size == 2 && (buf[0] & HIDP_HEADER_TRANS_MASK) == HIDP_TRANS_DATA) {
+		host->quirks = quirks_set (&host->addr, quirks_profile ("apple"));
+		return buf[1];
+	}
+
+	return -1;
+}
+
+/* Reply to a host request */
+static int
+handshake (fd, result)
+	int fd;
+	uint8_t result;
+{
+	uint8_t reply = HIDP_TRANS_HANDSHAKE | result;
+
+	COUNT(handshakes[result & HIDP_HEADER_PARAM_MASK], 1);
+	if (write (fd, &reply, 1) != 1) {
+		perror ("Could not reply with handshake.");
+		return -1;
+	}
+
+	return 0;
+}
+
 /* Read and process a command from given descriptor */
 static int
-btooth_command (status, fd, input)
-	struct status *status;
+btooth_command (host, fd)
+	struct host *host;
 	int fd;
-	int input;
 {
 	uint8_t buf[HIDP_DEFAULT_MTU];
 	int size;
-	uint8_t handshake = HIDP_TRANS_HANDSHAKE;
+	int leds;
 
 	size = read (fd, &buf, sizeof(buf));
 	switch (size) {
@@ -100,26 +288,34 @@ btooth_command (status, fd, input)
 	switch (buf[0] & HIDP_HEADER_TRANS_MASK) {
 	case HIDP_TRANS_SET_PROTOCOL:
 		/* Acknowledge anything -- both protocols have
-		 * the same descriptors for us */
-		handshake |= HIDP_HSHK_SUCCESSFUL;
-		if (write (fd, &handshake, 1) != 1) {
-			perror ("Could not reply with handshake.");
+		 * the same six key report for us. The N-key one
+		 * is only sent in the report protocol. */
+		host->protocol = buf[0] & HIDP_HEADER_PARAM_MASK;
+		if (handshake (fd, HIDP_HSHK_SUCCESSFUL) == -1)
+			return -1;
+		break;
+	case HIDP_TRANS_SET_REPORT:
+		/* Some hosts set the LEDs via the control channel */
+		if (host->quirks->leds == QUIRK_LEDS_ANY
+			|| (buf[0] & HIDP_DATA_RTYPE_MASK) != HIDP_DATA_RTYPE_OUTPUT)
+			goto unknown;
+		leds = parse_leds (host, buf, size);
+		if (leds == -1)
+			goto unknown;
+		host->leds = leds;
+		if (handshake (fd, HIDP_HSHK_SUCCESSFUL) == -1)
 			return -1;
-		}
 		break;
 	case HIDP_TRANS_DATA:
-		/* Apple (iPad) seemingly randomly sends either
-		 * "a2 01 xx" or "a2 xx" when setting LEDs... */
-		if (size == 3 || size == 2) {
-			set_leds (input, buf[size - 1]);
+		leds = parse_leds (host, buf, size);
+		if (leds != -1) {
+			host->leds = leds;
 			break;
 		}
 	default:
-		handshake |= HIDP_HSHK_ERR_UNKNOWN;
-		if (write (fd, &handshake, 1) != 1) {
-			perror ("Could not reply with handshake.");
+	unknown:
+		if (handshake (fd, HIDP_HSHK_ERR_UNKNOWN) == -1)
 			return -1;
-		}
 
 #ifdef DEBUG
 		int i;
@@ -133,91 +329,265 @@ btooth_command (status, fd, input)
 	return 0;
 }
 
-/* Process an evdev event */
+/* Fill the ring with as many events as the device has for us.
+ * Returns the number of events read, -1 on error. */
 static int
-input_event (status, input, ctrl, intr)
-	struct status *status;
+input_read (ring, input)
+	struct evring *ring;
 	int input;
-	int ctrl;
-	int intr;
 {
-	struct input_event event;
-	int mod = 0;
-
-	switch (read (input, &event, sizeof(event))) {
-	case -1:
-		perror ("Error reading from event device");
-		return -1;
-	case sizeof(event):
-		break;
-	default:
-		fprintf (stderr, "Badly sized read from event device.\n");
-		return -1;
+	unsigned int tail = ring->tail % EVRING_SIZE;
+	unsigned int free = EVRING_SIZE - (ring->tail - ring->head);
+	unsigned int len;
+	int count = 0;
+	ssize_t size;
+
+	/* The free space can wrap around the end of the buffer. Evdev
+	 * reads a vector a segment at a time anyway, so it's two reads
+	 * then; the device is non-blocking, so that the second one
+	 * returns right away if the first one took all there was. */
+	while (free) {
+		len = tail + free > EVRING_SIZE ? EVRING_SIZE - tail : free;
+		size = read (input, &ring->event[tail], len * sizeof(struct input_event));
+		if (size == -1) {
+			if (errno == EAGAIN)
+				break;
+			perror ("Error reading from event device");
+			return -1;
+		}
+		if (size == 0 || size % sizeof(struct input_event)) {
+			fprintf (stderr, "Badly sized read from event device.\n");
+			return -1;
+		}
+		count += size / sizeof(struct input_event);
+		free -= size / sizeof(struct input_event);
+		tail = (tail + size / sizeof(struct input_event)) % EVRING_SIZE;
+		if (size < len * sizeof(struct input_event))
+			break;
 	}
-
-	if (event.type != EV_KEY)
+	if (!count)
 		return 0;
 
-	/* We're just a poor 101-key keyboard. */
-	if (event.code >= 256) {
-		DBG("Ignored code 0x%x > 0xff.\n", event.code);
+	ring->tail += count;
+	ring->stamp = now_us ();
+	COUNT(events, count);
+	return count;
+}
+
+/* Fill the ring with as many events as the event channel has for us.
+ * Returns the number of events read, -1 on error. */
+static int
+input_take (ring, chan)
+	struct evring *ring;
+	struct evchan *chan;
+{
+	unsigned int tail = ring->tail % EVRING_SIZE;
+	unsigned int free = EVRING_SIZE - (ring->tail - ring->head);
+	unsigned int len;
+	int count = 0;
+	int n;
+
+	/* The free space can wrap around the end of the buffer */
+	while (free) {
+		len = tail + free > EVRING_SIZE ? EVRING_SIZE - tail : free;
+		n = evchan_read (chan, &ring->event[tail], len);
+		if (n == -1) {
+			perror ("Error reading from the event channel");
+			return -1;
+		}
+		count += n;
+		free -= n;
+		tail = (tail + n) % EVRING_SIZE;
+		if (n < len)
+			break;
+	}
+	if (!count)
 		return 0;
+
+	ring->tail += count;
+	ring->stamp = now_us ();
+	COUNT(events, count);
+	return count;
+}
+
+/* Track a key press or release. Setting the bit is all it takes for
+ * the N-key report; the array for the six key one is only maintained
+ * while it's not overflown. */
+static void
+keys_update (keys, usage, pressed)
+	struct keys *keys;
+	uint8_t usage;
+	int pressed;
+{
+	uint8_t bit = 1 << usage % 8;
+	int i, j;
+
+	/* Unknown key, or no change (autorepeat) */
+	if (!usage || !(keys->bits[usage / 8] & bit) == !pressed)
+		return;
+
+	if (pressed) {
+		keys->bits[usage / 8] |= bit;
+		if (keys->count < 6)
+			keys->key[keys->count] = usage;
+		else if (keys->count == 6)
+			COUNT(rollovers, 1);
+		keys->count++;
+		return;
 	}
 
-	/* Apply modifiers. "Left/RightGUI is Windows / Command / Meta" */
-	switch (event.code) {
-	case KEY_LEFTCTRL: mod = HIDP_LEFTCTRL; break;
-	case KEY_LEFTSHIFT: mod = HIDP_LEFTSHIFT; break;
-	case KEY_LEFTALT: mod = HIDP_LEFTALT; break;
-	case KEY_LEFTMETA: mod = HIDP_LEFTGUI; break;
-	case KEY_RIGHTCTRL: mod = HIDP_RIGHTCTRL; break;
-	case KEY_RIGHTSHIFT: mod = HIDP_RIGHTSHIFT; break;
-	case KEY_RIGHTALT: mod = HIDP_RIGHTALT; break;
-	case KEY_RIGHTMETA: mod = HIDP_RIGHTGUI; break;
+	keys->bits[usage / 8] &= ~bit;
+	keys->count--;
+
+	if (keys->count < 6) {
+		/* Remove it and shift the rest, keyboards do that */
+		for (i = 0; i < 6 && keys->key[i] != usage; i++);
+		for (; i < 5; i++)
+			keys->key[i] = keys->key[i + 1];
+		keys->key[5] = 0;
+	} else if (keys->count == 6) {
+		/* Back from the overflow. The order of presses is lost. */
+		for (i = j = 0; i < 256 && j < 6; i++) {
+			if (keys->bits[i / 8] & 1 << i % 8)
+				keys->key[j++] = i;
+		}
 	}
+}
 
-	if (mod) {
-		/* If a modifier was (de)pressed, update the track... */
-		if (event.value) {
-			status->report.mods |= mod;
+/* Apply a key press or release to the keyboard state */
+static void
+status_key (status, map, pressed)
+	struct status *status;
+	const struct keymap *map;
+	int pressed;
+{
+	if (map->bit) {
+		/* If a modifier or a control was (de)pressed, update the track... */
+		if (pressed) {
+			status->keys.slot[map->slot] |= map->bit;
 		} else {
-			status->report.mods &= ~mod;
+			status->keys.slot[map->slot] &= ~map->bit;
 		}
 	} else {
-		/* ...otherwise update the array of keys pressed. */
-		int i;
-		int code = linux2hid[event.code];
+		/* ...otherwise update the keys pressed. */
+		keys_update (&status->keys, map->usage, pressed);
+	}
+	status->changed |= 1 << map->slot;
+}
+
+/* The host switching hotkey, along with a number key, picks a host,
+ * or all of them with zero. Alone, it cycles through them. Neither
+ * gets to any host: the keys are not marked as held, so that their
+ * releases are ignored too. */
+static void
+input_hotkey (status, event)
+	struct status *status;
+	struct input_event *event;
+{
+	if (event->code != config.hotkey) {
+		if (event->code >= KEY_1 && event->code < KEY_1 + HOSTS)
+			status->select = event->code - KEY_1;
+		else if (event->code == KEY_0)
+			status->select = SELECT_ALL;
+		status->picked = 1;
+		return;
+	}
+
+	switch (event->value) {
+	case 1:
+		status->hotkey = 1;
+		status->picked = 0;
+		break;
+	case 0:
+		if (status->hotkey && !status->picked)
+			status->select = SELECT_NEXT;
+		status->hotkey = 0;
+		break;
+	}
+}
 
-		DBG("code %d value %d hid %d mods 0x%x\n",
-			event.code, event.value, linux2hid[event.code], status->report.mods);
+/* Process an evdev event of a keyboard.
+ * Returns 1 if the report is due to be sent to the host. */
+static int
+input_event (status, in)
+	struct status *status;
+	struct input *in;
+{
+	struct evring *ring = &in->ring;
+	struct input_event event;
+	const struct keymap *map;
+	uint32_t bit;
 
-		for (i = 0; i < 6; i++) {
-			/* Remove key if already enabled */
-			if (status->report.key[i] == code)
-				status->report.key[i] = 0;
+	event = ring->event[ring->head % EVRING_SIZE];
 
-			/* Add key if it was pushed */
-			if (event.value && status->report.key[i] == 0) {
-				status->report.key[i] = code;
-				break;
-			}
+	if (config.frames) {
+		/* Frame is complete, send what we've got */
+		if (event.type == EV_SYN && event.code == SYN_REPORT) {
+			ring->head++;
+			if (!status->changed)
+				return 0;
+			memset (status->frame, 0, sizeof(status->frame));
+			return 1;
+		}
 
-			/* Shift the rest. Probably not needed, but keyboards do that */
-			if (i < 5 && status->report.key[i] == 0) {
-				status->report.key[i] = status->report.key[i+1];
-				status->report.key[i+1] = 0;
-			}
+		/* A key changed twice within a frame (pressed and released).
+		 * Flush what we have first, so that the host sees both
+		 * transitions; the event stays queued for the next call. */
+		if (event.type == EV_KEY && event.code <= KEY_MAX
+			&& status->frame[event.code / 32] & 1 << event.code % 32) {
+			memset (status->frame, 0, sizeof(status->frame));
+			return 1;
 		}
 	}
+	ring->head++;
+
+	if (event.type != EV_KEY || event.code > KEY_MAX)
+		return 0;
+
+	if (config.hotkey && (event.code == config.hotkey
+		|| (status->hotkey && event.value == 1))) {
+		input_hotkey (status, &event);
+		return 0;
+	}
+
+	map = &linux2hid[event.code];
+	if (!map->report) {
+		DBG("Ignored code 0x%x.\n", event.code);
+		return 0;
+	}
+
+	/* Autorepeat, or a key another keyboard holds too */
+	bit = 1 << event.code % 32;
+	if (!(in->down[event.code / 32] & bit) == !event.value)
+		return 0;
+	in->down[event.code / 32] ^= bit;
+	if (event.value ? status->held[event.code]++ : --status->held[event.code])
+		return 0;
+
+	status->stamp = event.input_event_sec * 1000000LL + event.input_event_usec;
+	lat_record (LAT_READ, ring->stamp - status->stamp);
+
+	DBG("code %d value %d report 0x%02x usage 0x%04x:0x%04x\n", event.code,
+		event.value, map->report, map->page, map->usage);
+
+	status_key (status, map, event.value);
 
 #ifdef DEBUG
 	int i;
-	uint8_t *buf = (uint8_t *)&status->report;
-	for (i = 0; i < sizeof(status->report); i++)
-		fprintf (stderr, "%02x ", buf[i]);
+	fprintf (stderr, "%02x %02x %02x %d:", status->keys.slot[SLOT_MODS],
+		status->keys.slot[SLOT_EJECT], status->keys.slot[SLOT_MEDIA],
+		status->keys.count);
+	for (i = 0; i < 6; i++)
+		fprintf (stderr, " %02x", status->keys.key[i]);
 	fprintf (stderr, "\n");
 #endif
 
+	/* Wait for the end of the frame */
+	if (config.frames) {
+		status->frame[event.code / 32] |= 1 << event.code % 32;
+		return 0;
+	}
+
 	return 1;
 }
 
@@ -231,7 +601,7 @@ input_open (dev)
 	int input;
 	int norepeat[2] = { 0, 0 };
 
-	input = open (dev, O_RDWR);
+	input = open (dev, O_RDWR | O_NONBLOCK | O_CLOEXEC);
 	if (input == -1) {
 		perror (dev);
 		return -1;
@@ -264,6 +634,13 @@ input_open (dev)
 		goto fail;
 	}
 
+	/* Timestamp the events with the clock we use for the latency
+	 * measurements. Not a big deal if it's not possible. */
+	if (ioctl (input, EVIOCSCLOCKID, &(int){ CLOCK_MONOTONIC }) == -1)
+		perror ("Could not switch the event clock");
+	else
+		lat_enable ();
+
 	/* Host takes care of autorepeat itself */
 	if (ioctl (input, EVIOCSREP, norepeat) == -1) {
 		perror ("Could not disable autorepeat");
@@ -278,223 +655,1514 @@ fail:
 
 /* Handshake with Apple crap */
 static int
-hello (control)
-	int control;
+hello (host)
+	struct host *host;
 {
+	if (!host->quirks->handshake)
+		return 0;
+
 	/* Apple disconnects immediately,
 	 * if we don't send this within a second. */
-	if (write (control, "\xa1\x13\x03", 3) != 3) {
+	if (write (host->control, "\xa1\x13\x03", 3) != 3) {
 		perror ("Could not send a handshake.");
 		return -1;
 	}
-	if (write (control, "\xa1\x13\x02", 3) != 3) {
+	if (write (host->control, "\xa1\x13\x02", 3) != 3) {
 		perror ("Could not send a handshake.");
 		return -1;
 	}
-	/* Apple is known to require a small delay,
-	 * otherwise it eats the first character. */
-	sleep (1);
 
 	return 0;
 }
 
-/* Dispatch the work */
+/* Make the event loop watch the host channels. Channels being
+ * connected are waited for to become writable, and so is a congested
+ * interrupt channel. */
+static void
+host_watch (host)
+	struct host *host;
+{
+	ev_set (&host->control_src, host->control,
+		host->connecting & HOST_CONTROL ? EPOLLOUT : EPOLLIN);
+	ev_set (&host->intr_src, host->intr,
+		host->connecting & HOST_INTR ? EPOLLOUT
+		: host->congested ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+/* Drop the connection to host. Reports that were not sent are kept. */
+static void
+host_close (host)
+	struct host *host;
+{
+	ev_set (&host->control_src, -1, 0);
+	ev_set (&host->intr_src, -1, 0);
+
+	if (host->control != -1)
+		close (host->control);
+	if (host->intr != -1)
+		close (host->intr);
+	host->control = host->intr = -1;
+	host->connecting = 0;
+	host->ready = 0;
+	host->protocol = HIDP_PROTO_REPORT;
+	host->congested = 0;
+	if (host->state == HOST_UP)
+		GAUGE(up, counters.up - 1);
+	host->state = HOST_DOWN;
+	host->leds = 0;
+}
+
+/* Forget the reports that are too old to be of any use */
+static void
+host_expire (host)
+	struct host *host;
+{
+	struct queue *queue = &host->queue;
+	long long oldest = now () - config.backlog;
+
+	while (queue->head != queue->tail
+		&& queue->report[queue->head % QUEUE_SIZE].time < oldest) {
+		queue->head++;
+		COUNT(dropped, 1);
+	}
+}
+
+/* Both channels are connected and the handshake was sent.
+ * Apple is known to require a small delay, otherwise it eats the
+ * first character. Reports sent meanwhile are queued. */
+static void
+host_up (host)
+	struct host *host;
+{
+	/* Reports are written without blocking, if the link
+	 * is slow they wait in the queue */
+	if (fcntl (host->intr, F_SETFL, O_NONBLOCK) == -1)
+		perror ("Could not make the interrupt channel non-blocking");
+
+	if (host->state != HOST_UP)
+		GAUGE(up, counters.up + 1);
+	host->state = HOST_UP;
+	host->up = host->used = now ();
+	host->ready = host->up + host->quirks->delay;
+	memset (&host->sent, 0, sizeof(host->sent));
+	host_expire (host);
+}
+
+/* Start connecting both channels to a host at once.
+ * The event loop calls host_connected() as they come up. */
 static int
-session (src, tgt, input, sintr, scontrol)
-	bdaddr_t src;
+host_connect (host, src, tgt)
+	struct host *host;
+	bdaddr_t *src;
 	bdaddr_t *tgt;
-	int input, sintr, scontrol;
-{
-	int control = -1, intr = -1;	/* host sockets */
-	struct status status;		/* keyboard state */
-	struct pollfd pf[5];
-
-	/* Initialize the keyboard state */
-	status.report.type = HIDP_TRANS_DATA | HIDP_DATA_RTYPE_INPUT;
-	status.report.report = 0x01;
-	status.report.mods = 0;
-	status.report.reserved = 0;
-	status.report.key[0] = status.report.key[1] = status.report.key[2]
-		= status.report.key[3] = status.report.key[4]
-		= status.report.key[5] = 0;
-	status.leds = 0;
-	set_leds (input, status.leds);
-
-	/* Watch out */
-	pf[0].fd = input;
-	pf[1].fd = control;
-	pf[2].fd = intr;
-	pf[3].fd = scontrol;
-	pf[4].fd = sintr;
-	pf[0].events = pf[1].events = pf[2].events = pf[3].events
-		= pf[4].events = POLLIN | POLLERR | POLLHUP;
-
-	while (poll (pf, 5, -1) > 0) {
-		DBG("Entered main loop.\n");
-
-		if (pf[0].revents) {
-			int ret;
-
-			/* An input event */
-			pf[0].revents = 0;
-
-			/* Read the keyboard event and update status */
-			ret = input_event (&status, input, control, intr);
-			if (ret == -1) {
-				if (control != -1)
-					close (control);
-				if (intr != -1)
-					close (intr);
-				return 0;
-			}
-			if (ret == 0)
-				continue;
-			DBG("Input event.\n");
-
-			/* Noone managed to connect to us so far.
-			 * Try to reach out for a host ourselves. */
-			if (control == -1) {
-				/* Noone to talk to? */
-				if (!bacmp (tgt, BDADDR_ANY))
-					break;
-
-				pf[1].fd = control = l2cap_connect (&src, tgt, L2CAP_PSM_HIDP_CTRL);
-				if (control == -1)
-					break;
-				pf[2].fd = intr = l2cap_connect (&src, tgt, L2CAP_PSM_HIDP_INTR);
-				if (intr == -1) {
-					close (control);
-					control = -1;
-					break;
-				}
-				if (hello (control) == -1)
-					break;
-			}
+{
+	bacpy (&host->addr, tgt);
+	host->quirks = quirks_get (tgt);
+	COUNT(connects, 1);
+	host->control = config.transport->connect (src, tgt, L2CAP_PSM_HIDP_CTRL);
+	if (host->control == -1)
+		goto fail;
+	host->intr = config.transport->connect (src, tgt, L2CAP_PSM_HIDP_INTR);
+	if (host->intr == -1)
+		goto fail;
 
-			/* Send the packet to the host. */
-			if (write (intr, &status.report, sizeof(status.report)) <= 0) {
-				perror ("Could not send a packet to the host");
-				break;
-			}
+	host->state = HOST_CONNECTING;
+	host->connecting = HOST_CONTROL | HOST_INTR;
+	host->started = now ();
+	host->deadline = host->started + CONNECT_TIMEOUT;
+	host_watch (host);
 
-		}
-		if (pf[1].revents) {
-			/* Control connection command */
-			pf[1].revents = 0;
-			DBG("Control command.\n");
+	return 0;
+fail:
+	host_close (host);
+	COUNT(connect_failures, 1);
+	return -1;
+}
 
-			if (btooth_command (&status, control, input))
-				break;
-		}
-		if (pf[2].revents) {
-			/* Interrupt */
-			pf[2].revents = 0;
-			DBG("Interrupt.\n");
+/* A channel that was being connected became writable.
+ * Returns 1 once the host is ready for reports, -1 on failure. */
+static int
+host_connected (host, channel)
+	struct host *host;
+	int channel;
+{
+	if (config.transport->connected (channel == HOST_CONTROL ? host->control : host->intr) == -1)
+		return -1;
 
-			if (btooth_command (&status, intr, input))
-				break;
+	host->connecting &= ~channel;
+	host_watch (host);
+	if (host->connecting)
+		return 0;
+
+	if (hello (host) == -1)
+		return -1;
+	host_up (host);
+	COUNT(connected, 1);
+	COUNT(connect_ms, now () - host->started);
+
+	return 1;
+}
+
+/* Format a report the way the host wants it. Returns the length,
+ * 0 if the host can't take it. */
+static int
+host_report (host, slot, keys, buf)
+	struct host *host;
+	int slot;
+	struct keys *keys;
+	uint8_t *buf;
+{
+	struct key_report *report = (struct key_report *)buf;
+	struct nkro_report *nkro = (struct nkro_report *)buf;
+
+	/* Consumer controls are a byte of their own. The boot keyboard
+	 * has no usages to send them as; mute and volume are keys of the
+	 * keyboard page already, it's just these that get lost. */
+	if (slot != SLOT_MODS) {
+		if (host->quirks->boot || host->protocol != HIDP_PROTO_REPORT)
+			return 0;
+		buf[0] = HIDP_TRANS_DATA | HIDP_DATA_RTYPE_INPUT;
+		buf[1] = slot_report[slot];
+		buf[2] = keys->slot[slot];
+		return 3;
+	}
+
+	/* Everything in a single bitmap */
+	if (config.nkro && host->quirks->nkro && !host->quirks->boot
+		&& host->protocol == HIDP_PROTO_REPORT) {
+		nkro->type = HIDP_TRANS_DATA | HIDP_DATA_RTYPE_INPUT;
+		nkro->report = NKRO_REPORT_ID;
+		memcpy (nkro->bits, keys->bits, sizeof(nkro->bits));
+		nkro->bits[0xe0 / 8] = keys->slot[SLOT_MODS];
+		return sizeof(*nkro);
+	}
+
+	report->type = HIDP_TRANS_DATA | HIDP_DATA_RTYPE_INPUT;
+	report->report = KEY_REPORT_ID;
+	report->mods = keys->slot[SLOT_MODS];
+	report->reserved = 0;
+	if (keys->count > 6)
+		memset (report->key, HID_ERROR_ROLLOVER, sizeof(report->key));
+	else
+		memcpy (report->key, keys->key, sizeof(report->key));
+
+	return sizeof(*report);
+}
+
+/* Send out the reports that were held back, if it's the time already.
+ * A report stays queued if it could not be sent. */
+static int
+host_flush (host)
+	struct host *host;
+{
+	struct queue *queue = &host->queue;
+	struct report *report;
+	uint8_t buf[sizeof(struct nkro_report)];	/* The biggest one */
+	int len;
+
+	if (host->state != HOST_UP)
+		return 0;
+
+	while (queue->head != queue->tail) {
+		if (now () < host->ready)
+			return 0;
+
+		report = &queue->report[queue->head % QUEUE_SIZE];
+		len = host_report (host, report->slot, &report->keys, buf);
+		if (len == 0) {
+			queue->head++;
+			continue;
 		}
-		if (pf[3].revents) {
-			/* A host is likely attempting to connect. */
-			pf[3].revents = 0;
-			DBG("Control server activity.\n");
-
-			if (control != -1)
-				close (control);
-			pf[1].fd = control = l2cap_accept (scontrol, tgt);
-			if (control == -1)
-				break;
-			pf[3].fd = scontrol = -1;
+		if (write (host->intr, buf, len) <= 0) {
+			if (errno != EAGAIN) {
+				perror ("Could not send a packet to the host");
+				return -1;
+			}
+			/* Wait for the link to catch up */
+			if (!host->congested) {
+				host->congested = now ();
+				COUNT(stalls, 1);
+				host_watch (host);
+			}
+			return 0;
 		}
-		if (pf[4].revents) {
-			pf[4].revents = 0;
-			DBG("Interrupt server activity.\n");
+		if (host->congested) {
+			COUNT(stall_ms, now () - host->congested);
+			host->congested = 0;
+			host_watch (host);
+		}
+		host->sent = report->keys;
+		COUNT(sent, 1);
+		COUNT(bytes, len);
+		if (report->stamp)
+			lat_record (LAT_SENT, now_us () - report->stamp);
+		queue->head++;
+
+		/* Replay the backlog at a pace the host can keep up with */
+		if (queue->head != queue->tail)
+			host->ready = now () + REPLAY_INTERVAL;
+	}
 
-			/* Control connection needs to be connected first */
-			if (control == -1)
-				break;
+	return 0;
+}
 
-			if (intr != -1)
-				close (intr);
-			pf[2].fd = intr = l2cap_accept (sintr, NULL);
-			if (intr == -1)
-				break;
-			hello (control);
-			pf[4].fd = sintr = -1;
+/* Can a newer state replace an older one, without the host missing
+ * a key press or release? Not if it undoes a change the older one made
+ * to the one before it. */
+static int
+keys_collapsible (prev, old, new)
+	struct keys *prev;
+	struct keys *old;
+	struct keys *new;
+{
+	int i;
+
+	for (i = 0; i < sizeof(old->bits); i++) {
+		if ((prev->bits[i] ^ old->bits[i]) & (old->bits[i] ^ new->bits[i]))
+			return 0;
+	}
+	for (i = 0; i < SLOTS; i++) {
+		if ((prev->slot[i] ^ old->slot[i]) & (old->slot[i] ^ new->slot[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* The newest queued report, if the state can be merged into it */
+static struct report *
+host_collapse (host, slot, keys)
+	struct host *host;
+	int slot;
+	struct keys *keys;
+{
+	struct queue *queue = &host->queue;
+	struct report *last;
+	struct keys *prev;
+
+	if (queue->head == queue->tail)
+		return NULL;
+
+	last = &queue->report[(queue->tail - 1) % QUEUE_SIZE];
+	if (last->slot != slot)
+		return NULL;
+	if (queue->tail - 1 == queue->head)
+		prev = &host->sent;
+	else
+		prev = &queue->report[(queue->tail - 2) % QUEUE_SIZE].keys;
+
+	return keys_collapsible (prev, &last->keys, keys) ? last : NULL;
+}
+
+/* Send the changed parts of the keyboard state to the host, or queue
+ * them if the host can not take it now. */
+static int
+host_send (host, status)
+	struct host *host;
+	struct status *status;
+{
+	struct queue *queue = &host->queue;
+	struct report *report;
+	int slot;
+
+	for (slot = 0; slot < SLOTS; slot++) {
+		if (!(status->changed & 1 << slot))
+			continue;
+
+		/* While the link is congested, keep the queue short */
+		report = host->congested ? host_collapse (host, slot, &status->keys) : NULL;
+		if (report) {
+			COUNT(collapsed, 1);
+		} else {
+			/* If there's no room left, the newest report is replaced.
+			 * The host sees the right state at the end, at least. */
+			if (queue->tail - queue->head == QUEUE_SIZE) {
+				queue->tail--;
+				COUNT(dropped, 1);
+			}
+			report = &queue->report[queue->tail++ % QUEUE_SIZE];
+			report->stamp = 0;
 		}
+		report->time = now ();
+		report->slot = slot;
+		report->keys = status->keys;
+
+		/* Only the first report after a key event measures its latency */
+		if (!report->stamp)
+			report->stamp = status->stamp;
+		status->stamp = 0;
 	}
+	status->changed = 0;
 
-	if (control != -1)
-		close (control);
-	if (intr != -1)
-		close (intr);
+	return host_flush (host);
+}
 
-	return 1;
+/* How long can the event loop sleep before host needs attention,
+ * in milliseconds. Returns -1 for as long as it wants. */
+static int
+host_timeout (host, tgt)
+	struct host *host;
+	bdaddr_t *tgt;
+{
+	struct queue *queue = &host->queue;
+	long long when;
+
+	switch (host->state) {
+	case HOST_CONNECTING:
+		/* Give up connecting */
+		when = host->deadline;
+		break;
+	case HOST_UP:
+		/* Send the held back reports, unless it's the link
+		 * we wait for */
+		if (queue->head == queue->tail || host->congested)
+			return -1;
+		when = host->ready;
+		break;
+	default:
+		/* Reconnect to get rid of the backlog */
+		if (queue->head == queue->tail || host->control != -1
+			|| !bacmp (tgt, BDADDR_ANY) || !adapter_ready ())
+			return -1;
+		when = host->retry;
+		break;
+	}
+
+	when -= now ();
+	return when < 0 ? 0 : when;
 }
 
-int
-loop (device, src, tgt)
-	char *device;
+/* Everything the event handlers work with */
+struct session {
 	bdaddr_t src;
-	bdaddr_t *tgt;
+	bdaddr_t *tgt;		/* known hosts, BDADDR_ANY for a free slot */
+	struct input input[INPUTS];	/* keyboards */
+	int inputs;		/* how many of them are there */
+	int watch;		/* inotify of the directory with keyboards */
+	int scontrol, sintr;	/* server sockets */
+	int timer;
+	long long armed;	/* When is the timer set to go off */
+	long long metrics;	/* When are the counters written out next */
+	int adapter;		/* tells when the adapter is ready */
+	int worker;		/* eventfd waking the main thread up */
+	int work;		/* what it is to do */
+	int failed;		/* Fatal error, not a signal */
+	struct evrec record;	/* events read, in the order processed */
+	struct status status;	/* keyboard state */
+	struct host host[HOSTS];	/* connections to the hosts */
+	int active;		/* the one that gets the reports */
+	int broadcast;		/* ...along with all the others */
+	int uhid;		/* local sink */
+	struct host sink;	/* how are the reports formatted for it */
+	struct source scontrol_src, sintr_src, watch_src;
+	struct source timer_src, signal_src, uhid_src, adapter_src;
+};
+
+/* Set the keyboard state to nothing pressed */
+static void
+status_reset (status, inputs)
+	struct status *status;
+	struct input *inputs;
 {
-	int sintr, scontrol;	/* server sockets */
-	int input;		/* event device */
-	int hci = -1;
-	uint32_t save_class = 0;
+	int i;
 
-	/* Open the input event device */
-	input = input_open (device);
-	if (input == -1)
-		return 0;
+	memset (&status->keys, 0, sizeof(status->keys));
+	memset (status->frame, 0, sizeof(status->frame));
+	memset (status->held, 0, sizeof(status->held));
+	for (i = 0; i < INPUTS; i++)
+		memset (inputs[i].down, 0, sizeof(inputs[i].down));
+	status->changed = 0;
+	status->stamp = 0;
+	status->leds = 0;
+	inputs_leds (inputs, status->leds);
+}
 
-	/* Prepare the server sockets, in case a client will connect. */
-	sintr = l2cap_listen (&src, L2CAP_PSM_HIDP_INTR, 0, 1);
-	if (sintr == -1) {
-		close (input);
-		return 0;
+/* Have the main thread do some slow work, if input has a thread of
+ * its own. Otherwise it's done right away. */
+static void
+session_work (sess, work)
+	struct session *sess;
+	int work;
+{
+	uint64_t one = 1;
+
+	if (!config.realtime) {
+		if (work & WORK_METRICS)
+			stats_write (config.metrics);
+		if (work & WORK_QUIRKS)
+			quirks_save ();
+		return;
 	}
-	scontrol = l2cap_listen (&src, L2CAP_PSM_HIDP_CTRL, 0, 1);
-	if (scontrol == -1) {
-		close (input);
-		close (sintr);
-		return 0;
+
+	__atomic_fetch_or (&sess->work, work, __ATOMIC_RELEASE);
+	if (write (sess->worker, &one, sizeof(one)) != sizeof(one))
+		perror ("Could not wake the main thread");
+}
+
+/* Feed the changed reports to the local sink as well */
+static void
+sink_send (sess)
+	struct session *sess;
+{
+	uint8_t buf[sizeof(struct nkro_report)];
+	int slot, len;
+
+	for (slot = 0; slot < SLOTS; slot++) {
+		if (!(sess->status.changed & 1 << slot))
+			continue;
+		len = host_report (&sess->sink, slot, &sess->status.keys, buf);
+		/* It wants the report without the HIDP header */
+		if (len && uhid_input (sess->uhid, buf + 1, len - 1) == -1)
+			COUNT(dropped, 1);
 	}
+}
 
-	do {
-		if (hci == -1) {
-			if (bacmp (&src, BDADDR_ANY)) {
-				char addr[18];
+/* Tell the local sink nothing is held anymore, so that the keys don't
+ * stay stuck on it */
+static void
+sink_release (sess)
+	struct session *sess;
+{
+	struct status *status = &sess->status;
 
-				ba2str (&src, addr);
-				hci = hci_devid (addr);
-				/* Not yet plugged in or visited by udev? */
-				if (hci == -1)
-					perror ("Can not initialize HCI device");
-			} else {
-				/* No source device specified. Assume first. */
-				hci = 0;
-			}
-			if (hci >= 0) {
-				if (!save_class)
-					save_class = set_class (hci, 0x002540UL);
-				/* Retry opening HCI on next ocassion */
-				if (!save_class)
-					hci = -1;
-			}
-			if (hci >= 0) {
-				if (sdp_open () == 1)
-					sdp_add_keyboard ();
-			}
-		}
-	} while (session (src, tgt, input, sintr, scontrol));
-	sdp_remove ();
-	if (save_class)
-		set_class (hci, save_class);
+	if (sess->uhid == -1)
+		return;
+	status->changed = (1 << SLOTS) - 1;
+	sink_send (sess);
+	status->changed = 0;
+}
 
-	close (input);
-	close (sintr);
-	close (scontrol);
+/* The host went away or never came. Start over, if it's the one
+ * that gets the reports alone. */
+static void
+session_drop (sess, host)
+	struct session *sess;
+	struct host *host;
+{
+	struct keys none;
+	int held;
+
+	if (host->state == HOST_CONNECTING)
+		COUNT(connect_failures, 1);
+
+	/* A host that hangs up right after it got no handshake is
+	 * likely an Apple one, treat it as such from now on */
+	if (host->state == HOST_UP && !host->quirks->handshake && !host->quirks->boot
+		&& now () - host->up < HELLO_TIMEOUT)
+		host->quirks = quirks_set (&host->addr, quirks_profile ("apple"));
+
+	host_close (host);
+	host->retry = now () + RETRY_DELAY;
+	if (host == &sess->host[sess->active] && !sess->broadcast) {
+		memset (&none, 0, sizeof(none));
+		held = memcmp (&sess->status.keys, &none, sizeof(none));
+		status_reset (&sess->status, sess->input);
+		if (held)
+			sink_release (sess);
+	}
 
-	return 1;
+	/* Perhaps it's the adapter that went away */
+	adapter_kick ();
+}
+
+/* Does the host in given slot get the reports. When broadcasting,
+ * all the ones we know of do. */
+static int
+session_gets (sess, i)
+	struct session *sess;
+	int i;
+{
+	if (i == sess->active)
+		return 1;
+	return sess->broadcast && (sess->host[i].state != HOST_DOWN
+		|| bacmp (&sess->tgt[i], BDADDR_ANY));
+}
+
+/* Which host is the source for */
+static struct host *
+session_host (sess, source)
+	struct session *sess;
+	struct source *source;
+{
+	int i;
+
+	for (i = 0; i < HOSTS; i++) {
+		if (source == &sess->host[i].control_src || source == &sess->host[i].intr_src)
+			break;
+	}
+
+	return &sess->host[i];
+}
+
+/* Append the events that were processed to the recording */
+static void
+input_record (rec, ring, from)
+	struct evrec *rec;
+	struct evring *ring;
+	unsigned int from;
+{
+	unsigned int start = from % EVRING_SIZE;
+	unsigned int count = ring->head - from;
+
+	if (start + count > EVRING_SIZE) {
+		evrec_write (rec, &ring->event[start], EVRING_SIZE - start);
+		evrec_write (rec, &ring->event[0], count - (EVRING_SIZE - start));
+	} else {
+		evrec_write (rec, &ring->event[start], count);
+	}
+}
+
+/* Kernel time of the next event of a keyboard, in us */
+static long long
+input_time (in)
+	struct input *in;
+{
+	struct input_event *event = &in->ring.event[in->ring.head % EVRING_SIZE];
+
+	return event->input_event_sec * 1000000LL + event->input_event_usec;
+}
+
+/* The keyboard state changed, tell the hosts */
+static void
+session_report (sess)
+	struct session *sess;
+{
+	struct status *status = &sess->status;
+	int changed = status->changed;
+	long long stamp = status->stamp;
+	struct host *host;
+	bdaddr_t *tgt;
+	int i;
+
+	DBG("Input event.\n");
+	COUNT(reports, 1);
+	if (status->stamp)
+		lat_record (LAT_REPORT, now_us () - status->stamp);
+	if (sess->uhid != -1)
+		sink_send (sess);
+
+	for (i = 0; i < HOSTS; i++) {
+		if (!session_gets (sess, i))
+			continue;
+		host = &sess->host[i];
+		tgt = &sess->tgt[i];
+
+		/* Send the packet to the host, or keep it until there
+		 * is one. Each host has a queue of its own, one that
+		 * can't keep up only holds its own reports back. */
+		status->changed = changed;
+		status->stamp = stamp;
+		if (host_send (host, status) == -1) {
+			session_drop (sess, host);
+			if (!sess->broadcast)
+				return;
+			continue;
+		}
+
+		/* Noone managed to connect to us so far.
+		 * Try to reach out for a host ourselves,
+		 * unless we've just failed to. */
+		if (host->state == HOST_DOWN && host->control == -1
+			&& bacmp (tgt, BDADDR_ANY)
+			&& now () >= host->retry && adapter_ready ()) {
+			if (host_connect (host, &sess->src, tgt) == -1)
+				session_drop (sess, host);
+		}
+	}
+}
+
+/* Have the reports go to another host, or to all of them. The ones
+ * that got them so far are told that nothing is held anymore, the new
+ * ones are told what is. All stay connected, so that switching back
+ * and forth is instant. */
+static void
+session_switch (sess)
+	struct session *sess;
+{
+	struct status *status = &sess->status;
+	struct status idle;
+	struct host *host;
+	int to = status->select;
+	int i;
+
+	status->select = SELECT_NONE;
+
+	/* The next host we know of */
+	if (to == SELECT_NEXT) {
+		for (i = 1; i < HOSTS; i++) {
+			to = (sess->active + i) % HOSTS;
+			if (sess->host[to].state != HOST_DOWN || bacmp (&sess->tgt[to], BDADDR_ANY))
+				break;
+		}
+		if (i == HOSTS)
+			return;
+	}
+	if (to == SELECT_ALL ? sess->broadcast : !sess->broadcast && to == sess->active)
+		return;
+
+	for (i = 0; i < HOSTS; i++) {
+		if (!session_gets (sess, i) || to == SELECT_ALL || to == i)
+			continue;
+		host = &sess->host[i];
+		memset (&idle, 0, sizeof(idle));
+		idle.changed = (1 << SLOTS) - 1;
+		if ((host->state != HOST_DOWN || host->queue.head != host->queue.tail)
+			&& host_send (host, &idle) == -1)
+			session_drop (sess, host);
+	}
+
+	COUNT(switches, 1);
+	if (to == SELECT_ALL) {
+		DBG("Switching to all hosts.\n");
+		sess->broadcast = 1;
+	} else {
+		DBG("Switching to host %d.\n", to);
+		sess->broadcast = 0;
+		sess->active = to;
+		host = &sess->host[to];
+		host->used = now ();
+		status->leds = host->leds;
+		inputs_leds (sess->input, status->leds);
+	}
+
+	status->changed = (1 << SLOTS) - 1;
+	status->stamp = 0;
+	session_report (sess);
+}
+
+/* Process the events read from the keyboards. They're taken a frame
+ * at a time, from the keyboard with the oldest one first, so that the
+ * host sees the key presses in the order they happened. */
+static void
+session_merge (sess)
+	struct session *sess;
+{
+	struct input *in, *next;
+	struct input_event *event;
+	unsigned int from;
+	int syn;
+	int i;
+
+	for (;;) {
+		next = NULL;
+		for (i = 0; i < INPUTS; i++) {
+			in = &sess->input[i];
+			if (in->fd == -1 || in->ring.head == in->ring.tail)
+				continue;
+			if (!next || input_time (in) < input_time (next))
+				next = in;
+		}
+		if (!next)
+			return;
+
+		from = next->ring.head;
+		do {
+			event = &next->ring.event[next->ring.head % EVRING_SIZE];
+			syn = event->type == EV_SYN && event->code == SYN_REPORT;
+			/* Update status with a keyboard event */
+			if (input_event (&sess->status, next) == 1)
+				session_report (sess);
+			if (sess->status.select != SELECT_NONE)
+				session_switch (sess);
+		} while (!syn && next->ring.head != next->ring.tail);
+
+		if (sess->record.f)
+			input_record (&sess->record, &next->ring, from);
+	}
+}
+
+/* Stop watching a keyboard and close it */
+static void
+input_close (in)
+	struct input *in;
+{
+	ev_set (&in->src, -1, 0);
+	ev_set (&in->chan_src, -1, 0);
+	if (in->chan.ring)
+		evchan_close (&in->chan);
+	else if (in->fd != -1)
+		close (in->fd);
+	in->fd = -1;
+	free (in->path);
+	in->path = NULL;
+}
+
+/* Start reading a keyboard. A socket is where evmuxd hands its event
+ * channel out, anything else is an event device. */
+static int
+input_add (sess, path)
+	struct session *sess;
+	const char *path;
+{
+	struct input *in = NULL;
+	struct stat st;
+	int i;
+
+	for (i = 0; i < INPUTS; i++) {
+		if (sess->input[i].fd == -1) {
+			in = &sess->input[i];
+			break;
+		}
+	}
+	if (!in) {
+		fprintf (stderr, "%s: Too many keyboards\n", path);
+		return -1;
+	}
+
+	in->path = strdup (path);
+	if (!in->path)
+		return -1;
+	if (stat (in->path, &st) == 0 && S_ISSOCK (st.st_mode)) {
+		if (evchan_connect (&in->chan, in->path) == -1)
+			goto fail;
+		in->fd = in->chan.wake;
+		/* Hangs up when evmuxd goes away */
+		if (ev_set (&in->chan_src, in->chan.conn, EPOLLIN) == -1)
+			goto fail;
+		if (in->chan.clock == CLOCK_MONOTONIC)
+			lat_enable ();
+	} else {
+		in->fd = input_open (in->path);
+		if (in->fd == -1)
+			goto fail;
+	}
+	if (ev_set (&in->src, in->fd, EPOLLIN) == -1)
+		goto fail;
+
+	in->ring.head = in->ring.tail = 0;
+	memset (in->down, 0, sizeof(in->down));
+	if (!in->chan.ring)
+		set_leds (in->fd, sess->status.leds);
+	sess->inputs++;
+
+	return 0;
+fail:
+	input_close (in);
+	return -1;
+}
+
+/* Stop reading a keyboard. The keys it held are released. */
+static void
+input_remove (sess, in)
+	struct session *sess;
+	struct input *in;
+{
+	struct status *status = &sess->status;
+	int code;
+
+	input_close (in);
+	sess->inputs--;
+
+	for (code = 0; code <= KEY_MAX; code++) {
+		if (!(in->down[code / 32] & 1 << code % 32))
+			continue;
+		if (--status->held[code] == 0)
+			status_key (status, &linux2hid[code], 0);
+	}
+	memset (in->down, 0, sizeof(in->down));
+	if (status->changed) {
+		status->stamp = 0;
+		session_report (sess);
+	}
+
+	/* Nothing to read anymore */
+	if (!sess->inputs && sess->watch == -1) {
+		sess->failed = 1;
+		ev_quit ();
+	}
+}
+
+/* Input events, from any of the keyboards */
+static void
+on_input (source, events)
+	struct source *source;
+	uint32_t events;
+{
+	struct session *sess = source->data;
+	struct input *in;
+	int i;
+
+	/* Drain whatever the devices have queued up. All of them, so
+	 * that the events that came meanwhile can be put in order. */
+	for (i = 0; i < INPUTS; i++) {
+		in = &sess->input[i];
+		if (in->fd == -1)
+			continue;
+		if ((in->chan.ring ? input_take (&in->ring, &in->chan)
+			: input_read (&in->ring, in->fd)) == -1)
+			input_remove (sess, in);
+	}
+
+	session_merge (sess);
+}
+
+/* The event channel was closed, evmuxd went away */
+static void
+on_channel (source, events)
+	struct source *source;
+	uint32_t events;
+{
+	struct session *sess = source->data;
+	int i;
+
+	for (i = 0; i < INPUTS; i++) {
+		if (source == &sess->input[i].chan_src) {
+			fprintf (stderr, "%s: Event channel closed\n", sess->input[i].path);
+			input_remove (sess, &sess->input[i]);
+			break;
+		}
+	}
+}
+
+/* Is a keyboard read already */
+static int
+input_known (sess, path)
+	struct session *sess;
+	const char *path;
+{
+	int i;
+
+	for (i = 0; i < INPUTS; i++) {
+		if (sess->input[i].fd != -1 && !strcmp (sess->input[i].path, path))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Watch the directory for keyboards, and add the ones that are there
+ * already. udev removes the directory along with the last link in it,
+ * so it's created if it's not there. */
+static int
+watch_arm (sess)
+	struct session *sess;
+{
+	const char *dir = config.watch;
+	char path[PATH_MAX];
+	struct dirent *ent;
+	DIR *d;
+
+	if (mkdir (dir, 0755) == -1 && errno != EEXIST) {
+		perror (dir);
+		return -1;
+	}
+	if (inotify_add_watch (sess->watch, dir,
+			IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) == -1) {
+		perror (dir);
+		return -1;
+	}
+
+	d = opendir (dir);
+	if (!d) {
+		perror (dir);
+		return -1;
+	}
+	while ((ent = readdir (d))) {
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf (path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if (!input_known (sess, path))
+			input_add (sess, path);
+	}
+	closedir (d);
+
+	return 0;
+}
+
+/* Keyboards appearing in the watched directory are added, the ones
+ * disappearing from it are removed. If the directory itself goes
+ * away, it's watched anew. */
+static void
+on_watch (source, events)
+	struct source *source;
+	uint32_t events;
+{
+	struct session *sess = source->data;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	char path[PATH_MAX];
+	ssize_t len;
+	char *p;
+	int i;
+
+	len = read (sess->watch, buf, sizeof(buf));
+	if (len == -1) {
+		if (errno != EAGAIN)
+			perror ("Could not read the watched directory changes");
+		return;
+	}
+
+	for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *)p;
+		if (ev->mask & IN_IGNORED) {
+			if (watch_arm (sess) == -1 && !sess->inputs) {
+				sess->failed = 1;
+				ev_quit ();
+			}
+			continue;
+		}
+		if (!ev->len || ev->name[0] == '.')
+			continue;
+		snprintf (path, sizeof(path), "%s/%s", config.watch, ev->name);
+
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+			input_add (sess, path);
+			continue;
+		}
+		for (i = 0; i < INPUTS; i++) {
+			if (sess->input[i].fd != -1 && !strcmp (sess->input[i].path, path)) {
+				input_remove (sess, &sess->input[i]);
+				break;
+			}
+		}
+	}
+}
+
+/* Start watching the directory for keyboards */
+static int
+watch_open (sess)
+	struct session *sess;
+{
+	sess->watch = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	if (sess->watch == -1) {
+		perror ("Could not watch for keyboards");
+		return -1;
+	}
+	if (watch_arm (sess) == -1)
+		return -1;
+
+	return ev_set (&sess->watch_src, sess->watch, EPOLLIN);
+}
+
+/* Traffic on a host channel */
+static void
+on_host (source, events)
+	struct source *source;
+	uint32_t events;
+{
+	struct session *sess = source->data;
+	struct host *host = session_host (sess, source);
+	int channel = source == &host->control_src ? HOST_CONTROL : HOST_INTR;
+	int leds = host->leds;
+	int ret;
+
+	if (host->connecting & channel) {
+		/* Outgoing connection finished */
+		DBG("Channel 0x%x connected.\n", channel);
+		ret = host_connected (host, channel);
+	} else {
+		/* The link caught up */
+		ret = 0;
+		if (events & EPOLLOUT)
+			ret = host_flush (host);
+
+		/* Control command or interrupt */
+		if (ret != -1 && events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+			DBG("Channel 0x%x command.\n", channel);
+			ret = btooth_command (host, source->fd);
+		}
+	}
+
+	/* The keyboard shows the LEDs of the host that gets the keys,
+	 * or of the one that changed them last if they all do */
+	if ((sess->broadcast ? host->leds != leds : host == &sess->host[sess->active])
+		&& host->leds != sess->status.leds) {
+		sess->status.leds = host->leds;
+		inputs_leds (sess->input, host->leds);
+	}
+
+	/* Just connected, tell the host what's pressed. */
+	if (ret == 1 && session_gets (sess, host - sess->host)) {
+		sess->status.changed |= 1 << SLOT_MODS;
+		ret = host_send (host, &sess->status);
+	}
+	if (ret == -1)
+		session_drop (sess, host);
+}
+
+/* The slot for a host that connects to us: the one it had, a free one,
+ * or the one of the host that was used the least recently, as long as
+ * it's not connected. The host that gets the key presses is only
+ * replaced if there's no other. Returns -1 if they're all connected. */
+static int
+session_slot (sess, addr)
+	struct session *sess;
+	bdaddr_t *addr;
+{
+	struct host *host;
+	long long used, oldest = 0;
+	int slot = -1;
+	int i;
+
+	for (i = 0; i < HOSTS; i++) {
+		if (!bacmp (&sess->tgt[i], addr))
+			return i;
+	}
+
+	for (i = 0; i < HOSTS; i++) {
+		host = &sess->host[i];
+		if (host->state != HOST_DOWN || host->control != -1)
+			continue;
+		if (!bacmp (&sess->tgt[i], BDADDR_ANY)) {
+			bacpy (&sess->tgt[i], addr);
+			return i;
+		}
+		used = i == sess->active ? LLONG_MAX : host->used;
+		if (slot == -1 || used < oldest) {
+			slot = i;
+			oldest = used;
+		}
+	}
+	if (slot == -1)
+		return -1;
+
+	/* Its held back reports are of no use to the new one */
+	DBG("Replacing host %d.\n", slot);
+	host = &sess->host[slot];
+	COUNT(dropped, host->queue.tail - host->queue.head);
+	host->queue.head = host->queue.tail;
+	host->used = 0;
+	bacpy (&sess->tgt[slot], addr);
+
+	return slot;
+}
+
+/* A host is likely attempting to connect. It gets the slot it had,
+ * a free one, or one of a host that's not around. */
+static void
+on_scontrol (source, events)
+	struct source *source;
+	uint32_t events;
+{
+	struct session *sess = source->data;
+	struct host *host;
+	bdaddr_t addr;
+	int slot;
+	int fd;
+
+	DBG("Control server activity.\n");
+
+	fd = config.transport->accept (sess->scontrol, &addr);
+	if (fd == -1)
+		return;
+
+	slot = session_slot (sess, &addr);
+	if (slot == -1) {
+		fprintf (stderr, "No room for another host.\n");
+		close (fd);
+		return;
+	}
+	host = &sess->host[slot];
+
+	/* It wins over our own attempt to connect */
+	if (host->state == HOST_CONNECTING)
+		COUNT(connect_failures, 1);
+	host_close (host);
+	host->control = fd;
+	bacpy (&host->addr, &addr);
+	host->quirks = quirks_get (&addr);
+	host_watch (host);
+}
+
+/* The interrupt channel of a host whose control channel is connected */
+static void
+on_sintr (source, events)
+	struct source *source;
+	uint32_t events;
+{
+	struct session *sess = source->data;
+	struct host *host = NULL;
+	bdaddr_t addr;
+	int fd;
+	int i;
+
+	DBG("Interrupt server activity.\n");
+
+	fd = config.transport->accept (sess->sintr, &addr);
+	if (fd == -1)
+		return;
+
+	/* Control connection needs to be connected first */
+	for (i = 0; i < HOSTS && !host; i++) {
+		if (sess->host[i].control != -1 && sess->host[i].state != HOST_CONNECTING
+			&& !bacmp (&sess->host[i].addr, &addr))
+			host = &sess->host[i];
+	}
+	if (!host) {
+		close (fd);
+		return;
+	}
+
+	if (host->intr != -1) {
+		ev_set (&host->intr_src, -1, 0);
+		close (host->intr);
+	}
+	host->intr = fd;
+	hello (host);
+	host_up (host);
+	host_watch (host);
+	COUNT(accepts, 1);
+
+	/* Tell the host what's pressed, after whatever it missed.
+	 * That's what releases the keys it was left holding. */
+	if (session_gets (sess, host - sess->host)) {
+		sess->status.changed |= 1 << SLOT_MODS;
+		if (host_send (host, &sess->status) == -1)
+			session_drop (sess, host);
+	}
+}
+
+/* The local sink's LEDs were set, or it wants a report */
+static void
+on_uhid (source, events)
+	struct source *source;
+	uint32_t events;
+{
+	struct session *sess = source->data;
+	int leds;
+
+	leds = uhid_read (sess->uhid);
+	if (leds != -1) {
+		sess->status.leds = leds;
+		inputs_leds (sess->input, leds);
+	}
+}
+
+/* The adapter was set up, or it went away. The timer is set anew
+ * before the loop goes to sleep, to reconnect to the host if it's
+ * waited for. */
+static void
+on_adapter (source, events)
+	struct source *source;
+	uint32_t events;
+{
+	if (adapter_ack ())
+		DBG("Adapter ready.\n");
+	else
+		DBG("Adapter gone.\n");
+}
+
+/* Something that was waited for is due */
+static void
+on_timer (source, events)
+	struct source *source;
+	uint32_t events;
+{
+	struct session *sess = source->data;
+	struct host *host;
+	int i;
+
+	timer_ack (sess->timer);
+	sess->armed = -1;
+
+	for (i = 0; i < HOSTS; i++) {
+		host = &sess->host[i];
+		switch (host->state) {
+		case HOST_CONNECTING:
+			if (now () < host->deadline)
+				break;
+			/* The host did not answer */
+			fprintf (stderr, "Timed out connecting to the host.\n");
+			session_drop (sess, host);
+			break;
+		case HOST_UP:
+			if (host_flush (host) == -1)
+				session_drop (sess, host);
+			break;
+		default:
+			/* Reports from the last time are still waiting to be sent.
+			 * Don't wait for a key press to bring the host back. */
+			if (host_timeout (host, &sess->tgt[i]) == 0
+				&& host_connect (host, &sess->src, &sess->tgt[i]) == -1)
+				session_drop (sess, host);
+			break;
+		}
+	}
+}
+
+/* Termination or a status dump request */
+static void
+on_signal (source, events)
+	struct source *source;
+	uint32_t events;
+{
+	if (signals_read (source->fd) == SIGUSR1) {
+		lat_dump (stderr);
+		return;
+	}
+
+	ev_quit ();
+}
+
+/* Before the event loop goes to sleep: set the timer to wake us up
+ * when we should give up connecting, when the held back reports are
+ * due, when it's time to reconnect or to update the metrics. */
+static void
+session_prepare (data)
+	void *data;
+{
+	struct session *sess = data;
+	struct host *host;
+	long long when = -1;
+	int queued = 0;
+	int timeout;
+	int i;
+
+	for (i = 0; i < HOSTS; i++) {
+		host = &sess->host[i];
+		if (host->state == HOST_DOWN)
+			host_expire (host);
+		queued += host->queue.tail - host->queue.head;
+
+		timeout = host_timeout (host, &sess->tgt[i]);
+		if (timeout != -1 && (when == -1 || now () + timeout < when))
+			when = now () + timeout;
+	}
+	if (counters.queued != queued)
+		GAUGE(queued, queued);
+
+	/* A host we did not know, it's taken care of by now */
+	if (quirks_changed ())
+		session_work (sess, WORK_QUIRKS);
+
+	/* Don't rewrite the metrics file more often than needed */
+	if (config.metrics && __atomic_load_n (&counters.dirty, __ATOMIC_ACQUIRE)) {
+		if (now () >= sess->metrics) {
+			session_work (sess, WORK_METRICS);
+			sess->metrics = now () + METRICS_INTERVAL;
+		} else if (when == -1 || sess->metrics < when) {
+			when = sess->metrics;
+		}
+	}
+
+	if (when != sess->armed && timer_set (sess->timer, when) == 0)
+		sess->armed = when;
+}
+
+/* Initialize a source of events */
+static void
+source_init (source, handler, data)
+	struct source *source;
+	void (*handler) ();
+	void *data;
+{
+	source->fd = -1;
+	source->events = 0;
+	source->handler = handler;
+	source->data = data;
+}
+
+/* The input thread: the event loop, with nothing slow in its way */
+static void *
+session_thread (data)
+	void *data;
+{
+	struct session *sess = data;
+
+	rt_thread ();
+	ev_run (session_prepare, sess);
+	session_work (sess, WORK_QUIT);
+
+	return NULL;
+}
+
+/* Run the event loop on a thread of its own, while this one does the
+ * work it hands over, until it's done */
+static int
+session_spawn (sess)
+	struct session *sess;
+{
+	pthread_t thread;
+	uint64_t n;
+	int work = 0;
+	int ret;
+
+	ret = pthread_create (&thread, NULL, session_thread, sess);
+	if (ret) {
+		fprintf (stderr, "Could not start the input thread: %s\n", strerror (ret));
+		return -1;
+	}
+
+	while (!(work & WORK_QUIT)) {
+		if (read (sess->worker, &n, sizeof(n)) != sizeof(n))
+			continue;
+		work = __atomic_exchange_n (&sess->work, 0, __ATOMIC_ACQUIRE);
+		if (work & WORK_METRICS)
+			stats_write (config.metrics);
+		if (work & WORK_QUIRKS)
+			quirks_save ();
+	}
+
+	pthread_join (thread, NULL);
+	return 0;
+}
+
+int
+loop (devices, src, tgt)
+	char **devices;
+	bdaddr_t src;
+	bdaddr_t *tgt;
+{
+	static struct session sess;
+	struct host *host;
+	int sig;
+	int i;
+
+	bacpy (&sess.src, &src);
+	sess.tgt = tgt;
+	sess.scontrol = sess.sintr = sess.timer = sig = -1;
+	sess.adapter = -1;
+	sess.worker = -1;
+	sess.work = 0;
+	sess.failed = 0;
+	sess.armed = -1;
+	sess.metrics = 0;
+	sess.inputs = 0;
+	sess.watch = -1;
+	sess.uhid = -1;
+	sess.record.f = NULL;
+	sess.sink.quirks = quirks_profile ("generic");
+	sess.sink.protocol = HIDP_PROTO_REPORT;
+	sess.active = 0;
+	sess.status.select = SELECT_NONE;
+	sess.broadcast = config.broadcast;
+
+	for (i = 0; i < INPUTS; i++) {
+		sess.input[i].fd = -1;
+		sess.input[i].path = NULL;
+		sess.input[i].chan.ring = NULL;
+		source_init (&sess.input[i].src, on_input, &sess);
+		source_init (&sess.input[i].chan_src, on_channel, &sess);
+	}
+	source_init (&sess.watch_src, on_watch, &sess);
+	source_init (&sess.scontrol_src, on_scontrol, &sess);
+	source_init (&sess.sintr_src, on_sintr, &sess);
+	source_init (&sess.timer_src, on_timer, &sess);
+	source_init (&sess.signal_src, on_signal, &sess);
+	source_init (&sess.uhid_src, on_uhid, &sess);
+	source_init (&sess.adapter_src, on_adapter, &sess);
+
+	for (i = 0; i < HOSTS; i++) {
+		host = &sess.host[i];
+		source_init (&host->control_src, on_host, &sess);
+		source_init (&host->intr_src, on_host, &sess);
+		host->control = host->intr = -1;
+		host_close (host);
+		host->retry = 0;
+		host->used = 0;
+		host->queue.head = host->queue.tail = 0;
+	}
+
+	if (ev_init () == -1)
+		return 0;
+
+	/* Open the input event devices */
+	for (; *devices; devices++) {
+		if (input_add (&sess, *devices) == -1)
+			goto fail;
+	}
+	if (config.watch && watch_open (&sess) == -1)
+		goto fail;
+
+	/* Prepare the server sockets, in case a client will connect. */
+	sess.sintr = config.transport->listen (&sess.src, L2CAP_PSM_HIDP_INTR, 0, 1);
+	if (sess.sintr == -1)
+		goto fail;
+	sess.scontrol = config.transport->listen (&sess.src, L2CAP_PSM_HIDP_CTRL, 0, 1);
+	if (sess.scontrol == -1)
+		goto fail;
+
+	if (config.record && evrec_open (&sess.record, config.record) == -1)
+		goto fail;
+
+	/* Local sink for the reports */
+	if (config.uhid) {
+		sess.uhid = uhid_open ("btkbdd");
+		if (sess.uhid == -1)
+			goto fail;
+		if (ev_set (&sess.uhid_src, sess.uhid, EPOLLIN) == -1)
+			goto fail;
+	}
+
+	sess.timer = timer_open ();
+	if (sess.timer == -1)
+		goto fail;
+	sig = signals_open ();
+	if (sig == -1)
+		goto fail;
+
+	if (config.realtime) {
+		sess.worker = eventfd (0, EFD_CLOEXEC);
+		if (sess.worker == -1) {
+			perror ("Could not create an eventfd");
+			goto fail;
+		}
+	}
+
+	if (ev_set (&sess.timer_src, sess.timer, EPOLLIN) == -1)
+		goto fail;
+	if (ev_set (&sess.signal_src, sig, EPOLLIN) == -1)
+		goto fail;
+	if (ev_set (&sess.scontrol_src, sess.scontrol, EPOLLIN) == -1)
+		goto fail;
+	if (ev_set (&sess.sintr_src, sess.sintr, EPOLLIN) == -1)
+		goto fail;
+
+	/* The adapter is set up on the side, the keyboard works
+	 * meanwhile. Needs the signals blocked already. */
+	if (config.transport->adapter) {
+		sess.adapter = adapter_start (&sess.src);
+		if (sess.adapter == -1)
+			goto fail;
+		if (ev_set (&sess.adapter_src, sess.adapter, EPOLLIN) == -1)
+			goto fail;
+	}
+
+	status_reset (&sess.status, sess.input);
+	for (i = 0; i < HOSTS; i++)
+		session_drop (&sess, &sess.host[i]);
+	if (config.realtime) {
+		if (session_spawn (&sess) == -1)
+			sess.failed = 1;
+	} else {
+		ev_run (session_prepare, &sess);
+	}
+
+	for (i = 0; i < HOSTS; i++)
+		host_close (&sess.host[i]);
+	lat_dump (stderr);
+	if (config.metrics)
+		stats_write (config.metrics);
+
+fail:
+	for (i = 0; i < INPUTS; i++) {
+		if (sess.input[i].fd != -1)
+			input_close (&sess.input[i]);
+	}
+	if (sess.watch != -1) {
+		ev_set (&sess.watch_src, -1, 0);
+		close (sess.watch);
+	}
+	if (sess.sintr != -1)
+		close (sess.sintr);
+	if (sess.scontrol != -1)
+		close (sess.scontrol);
+	if (sess.timer != -1)
+		close (sess.timer);
+	if (sess.worker != -1)
+		close (sess.worker);
+	if (sess.uhid != -1) {
+		ev_set (&sess.uhid_src, -1, 0);
+		uhid_close (sess.uhid);
+	}
+	evrec_close (&sess.record);
+	if (sess.adapter != -1) {
+		ev_set (&sess.adapter_src, -1, 0);
+		adapter_stop ();
+	}
+	if (sig != -1)
+		close (sig);
+	ev_done ();
+
+	return !sess.failed && sig != -1;
 }
@@ -8,6 +8,8 @@
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <bluetooth/hidp.h>
 
@@ -96,7 +98,14 @@ int l2cap_connect(bdaddr_t *src, bdaddr_t *dst, unsigned short psm)
 	bacpy(&addr.l2_bdaddr, dst);
 	addr.l2_psm = htobs(psm);
 
-	if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+	/* Don't wait for the paging to finish, l2cap_connected() tells
+	 * once the socket becomes writable. */
+	if (fcntl(sk, F_SETFL, O_NONBLOCK) < 0) {
+		perror ("Cannot make a L2CAP client socket non-blocking");
+		goto fail;
+	}
+
+	if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
 		perror ("Cannot connect to a L2CAP client socket");
 		goto fail;
 	}
@@ -107,6 +116,29 @@ fail:
 	return -1;
 }
 
+int l2cap_connected(int sk)
+{
+	int err;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(sk, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+		perror ("Cannot get L2CAP connection status");
+		return -1;
+	}
+	if (err) {
+		errno = err;
+		perror ("Cannot connect to a L2CAP client socket");
+		return -1;
+	}
+
+	if (fcntl(sk, F_SETFL, 0) < 0) {
+		perror ("Cannot make a L2CAP client socket blocking");
+		return -1;
+	}
+
+	return 0;
+}
+
 int l2cap_accept(int sk, bdaddr_t *bdaddr)
 {
 	struct sockaddr_l2 addr;
@@ -126,3 +158,12 @@ int l2cap_accept(int sk, bdaddr_t *bdaddr)
 
 	return nsk;
 }
+
+struct transport l2cap_transport = {
+	.name = "l2cap",
+	.listen = l2cap_listen,
+	.accept = l2cap_accept,
+	.connect = l2cap_connect,
+	.connected = l2cap_connected,
+	.adapter = 1,
+};
@@ -6,168 +6,215 @@
  * License: GPL
  */
 
+#include <stdint.h>
 #include <linux/input.h>
 
-unsigned char linux2hid[0x100] = {
-	[KEY_RESERVED] = 0,
-	[KEY_ESC] = 41,
-	[KEY_1] = 30,
-	[KEY_2] = 31,
-	[KEY_3] = 32,
-	[KEY_4] = 33,
-	[KEY_5] = 34,
-	[KEY_6] = 35,
-	[KEY_7] = 36,
-	[KEY_8] = 37,
-	[KEY_9] = 38,
-	[KEY_0] = 39,
-	[KEY_MINUS] = 45,
-	[KEY_EQUAL] = 46,
-	[KEY_BACKSPACE] = 42,
-	[KEY_TAB] = 43,
-	[KEY_Q] = 20,
-	[KEY_W] = 26,
-	[KEY_E] = 8,
-	[KEY_R] = 21,
-	[KEY_T] = 23,
-	[KEY_Y] = 28,
-	[KEY_U] = 24,
-	[KEY_I] = 12,
-	[KEY_O] = 18,
-	[KEY_P] = 19,
-	[KEY_LEFTBRACE] = 47,
-	[KEY_RIGHTBRACE] = 48,
-	[KEY_ENTER] = 40,
-	[KEY_LEFTCTRL] = 224,
-	[KEY_A] = 4,
-	[KEY_S] = 22,
-	[KEY_D] = 7,
-	[KEY_F] = 9,
-	[KEY_G] = 10,
-	[KEY_H] = 11,
-	[KEY_J] = 13,
-	[KEY_K] = 14,
-	[KEY_L] = 15,
-	[KEY_SEMICOLON] = 51,
-	[KEY_APOSTROPHE] = 52,
-	[KEY_GRAVE] = 53,
-	[KEY_LEFTSHIFT] = 225,
-	[KEY_BACKSLASH] = 50,
-	[KEY_Z] = 29,
-	[KEY_X] = 27,
-	[KEY_C] = 6,
-	[KEY_V] = 25,
-	[KEY_B] = 5,
-	[KEY_N] = 17,
-	[KEY_M] = 16,
-	[KEY_COMMA] = 54,
-	[KEY_DOT] = 55,
-	[KEY_SLASH] = 56,
-	[KEY_RIGHTSHIFT] = 229,
-	[KEY_KPASTERISK] = 85,
-	[KEY_LEFTALT] = 226,
-	[KEY_SPACE] = 44,
-	[KEY_CAPSLOCK] = 57,
-	[KEY_F1] = 58,
-	[KEY_F2] = 59,
-	[KEY_F3] = 60,
-	[KEY_F4] = 61,
-	[KEY_F5] = 62,
-	[KEY_F6] = 63,
-	[KEY_F7] = 64,
-	[KEY_F8] = 65,
-	[KEY_F9] = 66,
-	[KEY_F10] = 67,
-	[KEY_NUMLOCK] = 83,
-	[KEY_SCROLLLOCK] = 71,
-	[KEY_KP7] = 95,
-	[KEY_KP8] = 96,
-	[KEY_KP9] = 97,
-	[KEY_KPMINUS] = 86,
-	[KEY_KP4] = 92,
-	[KEY_KP5] = 93,
-	[KEY_KP6] = 94,
-	[KEY_KPPLUS] = 87,
-	[KEY_KP1] = 89,
-	[KEY_KP2] = 90,
-	[KEY_KP3] = 91,
-	[KEY_KP0] = 98,
-	[KEY_KPDOT] = 99,
-	[KEY_ZENKAKUHANKAKU] = 148,
-	[KEY_102ND] = 100,
-	[KEY_F11] = 68,
-	[KEY_F12] = 69,
-	[KEY_RO] = 135,
-	[KEY_KATAKANA] = 146,
-	[KEY_HIRAGANA] = 147,
-	[KEY_HENKAN] = 138,
-	[KEY_KATAKANAHIRAGANA] = 136,
-	[KEY_MUHENKAN] = 139,
-	[KEY_KPJPCOMMA] = 140,
-	[KEY_KPENTER] = 88,
-	[KEY_RIGHTCTRL] = 228,
-	[KEY_KPSLASH] = 84,
-	[KEY_SYSRQ] = 70,
-	[KEY_RIGHTALT] = 230,
-	[KEY_HOME] = 74,
-	[KEY_UP] = 82,
-	[KEY_PAGEUP] = 75,
-	[KEY_LEFT] = 80,
-	[KEY_RIGHT] = 79,
-	[KEY_END] = 77,
-	[KEY_DOWN] = 81,
-	[KEY_PAGEDOWN] = 78,
-	[KEY_INSERT] = 73,
-	[KEY_DELETE] = 76,
-	[KEY_MUTE] = 239,
-	[KEY_VOLUMEDOWN] = 238,
-	[KEY_VOLUMEUP] = 237,
-	[KEY_POWER] = 102,
-	[KEY_KPEQUAL] = 103,
-	[KEY_PAUSE] = 72,
-	[KEY_KPCOMMA] = 133,
-	[KEY_HANGEUL] = 144,
-	[KEY_HANJA] = 145,
-	[KEY_YEN] = 137,
-	[KEY_LEFTMETA] = 227,
-	[KEY_RIGHTMETA] = 231,
-	[KEY_COMPOSE] = 101,
-	[KEY_STOP] = 243,
-	[KEY_AGAIN] = 121,
-	[KEY_PROPS] = 118,
-	[KEY_UNDO] = 122,
-	[KEY_FRONT] = 119,
-	[KEY_COPY] = 124,
-	[KEY_OPEN] = 116,
-	[KEY_PASTE] = 125,
-	[KEY_FIND] = 244,
-	[KEY_CUT] = 123,
-	[KEY_HELP] = 117,
-	[KEY_CALC] = 251,
-	[KEY_SLEEP] = 248,
-	[KEY_WWW] = 240,
-	[KEY_COFFEE] = 249,
-	[KEY_BACK] = 241,
-	[KEY_FORWARD] = 242,
-	[KEY_EJECTCD] = 236,
-	[KEY_NEXTSONG] = 235,
-	[KEY_PLAYPAUSE] = 232,
-	[KEY_PREVIOUSSONG] = 234,
-	[KEY_STOPCD] = 233,
-	[KEY_REFRESH] = 250,
-	[KEY_EDIT] = 247,
-	[KEY_SCROLLUP] = 245,
-	[KEY_SCROLLDOWN] = 246,
-	[KEY_F13] = 104,
-	[KEY_F14] = 105,
-	[KEY_F15] = 106,
-	[KEY_F16] = 107,
-	[KEY_F17] = 108,
-	[KEY_F18] = 109,
-	[KEY_F19] = 110,
-	[KEY_F20] = 111,
-	[KEY_F21] = 112,
-	[KEY_F22] = 113,
-	[KEY_F23] = 114,
-	[KEY_F24] = 115
+#include "hid.h"
+
+/* What a key code stands for in the reports we send. Keys of the keyboard
+ * usage page go to the key array (or bitmap) of the keyboard report; the
+ * modifiers and the consumer controls are a bit in a byte of the keyboard
+ * state, which is sent in a report of its own. */
+struct keymap {
+	uint8_t report;		/* Report ID, 0 for keys we can't send */
+	uint8_t slot;		/* Which byte holds the bit */
+	uint8_t bit;		/* 0 for keys of the array */
+	uint8_t reserved;
+	uint16_t page;		/* HID usage page */
+	uint16_t usage;
 };
+
+/* Keyboard state bytes for keys that are just a bit */
+#define SLOT_MODS	0	/* Modifiers, in the keyboard report */
+#define SLOT_EJECT	1	/* Eject and Fn */
+#define SLOT_MEDIA	2	/* Playback and brightness controls */
+#define SLOTS		3
+
+static const uint8_t slot_report[SLOTS] = {
+	[SLOT_MODS] = KEY_REPORT_ID,
+	[SLOT_EJECT] = EJECT_REPORT_ID,
+	[SLOT_MEDIA] = MEDIA_REPORT_ID,
+};
+
+#define K(u) { KEY_REPORT_ID, 0, 0, 0, 0x07, (u) }
+#define M(u) { KEY_REPORT_ID, SLOT_MODS, 1 << ((u) - 0xe0), 0, 0x07, (u) }
+#define EJECT(b, p, u) { EJECT_REPORT_ID, SLOT_EJECT, (b), 0, (p), (u) }
+#define MEDIA(b, p, u) { MEDIA_REPORT_ID, SLOT_MEDIA, (b), 0, (p), (u) }
+
+/* Covers all the key codes, so that there's no need to check the range.
+ * Left/RightGUI is Windows / Command / Meta. */
+static const struct keymap linux2hid[KEY_MAX + 1] = {
+	[KEY_ESC] = K(0x29),
+	[KEY_1] = K(0x1e),
+	[KEY_2] = K(0x1f),
+	[KEY_3] = K(0x20),
+	[KEY_4] = K(0x21),
+	[KEY_5] = K(0x22),
+	[KEY_6] = K(0x23),
+	[KEY_7] = K(0x24),
+	[KEY_8] = K(0x25),
+	[KEY_9] = K(0x26),
+	[KEY_0] = K(0x27),
+	[KEY_MINUS] = K(0x2d),
+	[KEY_EQUAL] = K(0x2e),
+	[KEY_BACKSPACE] = K(0x2a),
+	[KEY_TAB] = K(0x2b),
+	[KEY_Q] = K(0x14),
+	[KEY_W] = K(0x1a),
+	[KEY_E] = K(0x08),
+	[KEY_R] = K(0x15),
+	[KEY_T] = K(0x17),
+	[KEY_Y] = K(0x1c),
+	[KEY_U] = K(0x18),
+	[KEY_I] = K(0x0c),
+	[KEY_O] = K(0x12),
+	[KEY_P] = K(0x13),
+	[KEY_LEFTBRACE] = K(0x2f),
+	[KEY_RIGHTBRACE] = K(0x30),
+	[KEY_ENTER] = K(0x28),
+	[KEY_LEFTCTRL] = M(0xe0),
+	[KEY_A] = K(0x04),
+	[KEY_S] = K(0x16),
+	[KEY_D] = K(0x07),
+	[KEY_F] = K(0x09),
+	[KEY_G] = K(0x0a),
+	[KEY_H] = K(0x0b),
+	[KEY_J] = K(0x0d),
+	[KEY_K] = K(0x0e),
+	[KEY_L] = K(0x0f),
+	[KEY_SEMICOLON] = K(0x33),
+	[KEY_APOSTROPHE] = K(0x34),
+	[KEY_GRAVE] = K(0x35),
+	[KEY_LEFTSHIFT] = M(0xe1),
+	[KEY_BACKSLASH] = K(0x32),
+	[KEY_Z] = K(0x1d),
+	[KEY_X] = K(0x1b),
+	[KEY_C] = K(0x06),
+	[KEY_V] = K(0x19),
+	[KEY_B] = K(0x05),
+	[KEY_N] = K(0x11),
+	[KEY_M] = K(0x10),
+	[KEY_COMMA] = K(0x36),
+	[KEY_DOT] = K(0x37),
+	[KEY_SLASH] = K(0x38),
+	[KEY_RIGHTSHIFT] = M(0xe5),
+	[KEY_KPASTERISK] = K(0x55),
+	[KEY_LEFTALT] = M(0xe2),
+	[KEY_SPACE] = K(0x2c),
+	[KEY_CAPSLOCK] = K(0x39),
+	[KEY_F1] = K(0x3a),
+	[KEY_F2] = K(0x3b),
+	[KEY_F3] = K(0x3c),
+	[KEY_F4] = K(0x3d),
+	[KEY_F5] = K(0x3e),
+	[KEY_F6] = K(0x3f),
+	[KEY_F7] = K(0x40),
+	[KEY_F8] = K(0x41),
+	[KEY_F9] = K(0x42),
+	[KEY_F10] = K(0x43),
+	[KEY_NUMLOCK] = K(0x53),
+	[KEY_SCROLLLOCK] = K(0x47),
+	[KEY_KP7] = K(0x5f),
+	[KEY_KP8] = K(0x60),
+	[KEY_KP9] = K(0x61),
+	[KEY_KPMINUS] = K(0x56),
+	[KEY_KP4] = K(0x5c),
+	[KEY_KP5] = K(0x5d),
+	[KEY_KP6] = K(0x5e),
+	[KEY_KPPLUS] = K(0x57),
+	[KEY_KP1] = K(0x59),
+	[KEY_KP2] = K(0x5a),
+	[KEY_KP3] = K(0x5b),
+	[KEY_KP0] = K(0x62),
+	[KEY_KPDOT] = K(0x63),
+	[KEY_ZENKAKUHANKAKU] = K(0x94),
+	[KEY_102ND] = K(0x64),
+	[KEY_F11] = K(0x44),
+	[KEY_F12] = K(0x45),
+	[KEY_RO] = K(0x87),
+	[KEY_KATAKANA] = K(0x92),
+	[KEY_HIRAGANA] = K(0x93),
+	[KEY_HENKAN] = K(0x8a),
+	[KEY_KATAKANAHIRAGANA] = K(0x88),
+	[KEY_MUHENKAN] = K(0x8b),
+	[KEY_KPJPCOMMA] = K(0x8c),
+	[KEY_KPENTER] = K(0x58),
+	[KEY_RIGHTCTRL] = M(0xe4),
+	[KEY_KPSLASH] = K(0x54),
+	[KEY_SYSRQ] = K(0x46),
+	[KEY_RIGHTALT] = M(0xe6),
+	[KEY_HOME] = K(0x4a),
+	[KEY_UP] = K(0x52),
+	[KEY_PAGEUP] = K(0x4b),
+	[KEY_LEFT] = K(0x50),
+	[KEY_RIGHT] = K(0x4f),
+	[KEY_END] = K(0x4d),
+	[KEY_DOWN] = K(0x51),
+	[KEY_PAGEDOWN] = K(0x4e),
+	[KEY_INSERT] = K(0x49),
+	[KEY_DELETE] = K(0x4c),
+	[KEY_MUTE] = K(0xef),
+	[KEY_VOLUMEDOWN] = K(0xee),
+	[KEY_VOLUMEUP] = K(0xed),
+	[KEY_POWER] = K(0x66),
+	[KEY_KPEQUAL] = K(0x67),
+	[KEY_PAUSE] = K(0x48),
+	[KEY_KPCOMMA] = K(0x85),
+	[KEY_HANGEUL] = K(0x90),
+	[KEY_HANJA] = K(0x91),
+	[KEY_YEN] = K(0x89),
+	[KEY_LEFTMETA] = M(0xe3),
+	[KEY_RIGHTMETA] = M(0xe7),
+	[KEY_COMPOSE] = K(0x65),
+	[KEY_STOP] = K(0xf3),
+	[KEY_AGAIN] = K(0x79),
+	[KEY_PROPS] = K(0x76),
+	[KEY_UNDO] = K(0x7a),
+	[KEY_FRONT] = K(0x77),
+	[KEY_COPY] = K(0x7c),
+	[KEY_OPEN] = K(0x74),
+	[KEY_PASTE] = K(0x7d),
+	[KEY_FIND] = K(0xf4),
+	[KEY_CUT] = K(0x7b),
+	[KEY_HELP] = K(0x75),
+	[KEY_CALC] = K(0xfb),
+	[KEY_SLEEP] = K(0xf8),
+	[KEY_WWW] = K(0xf0),
+	[KEY_COFFEE] = K(0xf9),
+	[KEY_BACK] = K(0xf1),
+	[KEY_FORWARD] = K(0xf2),
+	[KEY_EJECTCD] = EJECT(0x08, 0x0c, 0xb8),
+	[KEY_NEXTSONG] = MEDIA(0x08, 0x0c, 0xb5),
+	[KEY_PLAYPAUSE] = MEDIA(0x01, 0x0c, 0xcd),
+	[KEY_PREVIOUSSONG] = MEDIA(0x10, 0x0c, 0xb6),
+	[KEY_STOPCD] = K(0xe9),
+	[KEY_REFRESH] = K(0xfa),
+	[KEY_EDIT] = K(0xf7),
+	[KEY_SCROLLUP] = K(0xf5),
+	[KEY_SCROLLDOWN] = K(0xf6),
+	[KEY_F13] = K(0x68),
+	[KEY_F14] = K(0x69),
+	[KEY_F15] = K(0x6a),
+	[KEY_F16] = K(0x6b),
+	[KEY_F17] = K(0x6c),
+	[KEY_F18] = K(0x6d),
+	[KEY_F19] = K(0x6e),
+	[KEY_F20] = K(0x6f),
+	[KEY_F21] = K(0x70),
+	[KEY_F22] = K(0x71),
+	[KEY_F23] = K(0x72),
+	[KEY_F24] = K(0x73),
+
+	/* Consumer controls the Apple descriptor knows about */
+	[KEY_EJECTCLOSECD] = EJECT(0x08, 0x0c, 0xb8),
+	[KEY_FN] = EJECT(0x10, 0xff00, 0x03),
+	[KEY_FASTFORWARD] = MEDIA(0x02, 0x0c, 0xb3),
+	[KEY_REWIND] = MEDIA(0x04, 0x0c, 0xb4),
+	[KEY_BRIGHTNESSUP] = MEDIA(0x20, 0x0c, 0x6f),
+	[KEY_BRIGHTNESSDOWN] = MEDIA(0x40, 0x0c, 0x70),
+};
+
+#undef K
+#undef M
+#undef EJECT
+#undef MEDIA
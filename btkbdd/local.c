@@ -0,0 +1,159 @@
+/*
+ * Local transport: HIDP over UNIX sequential packet sockets,
+ * for testing and benchmarking without a Bluetooth adapter
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "btkbdd.h"
+#include "hid.h"
+
+/* Sockets are named <path>.ctrl and <path>.intr, the ones we connect to
+ * are <path>.host.ctrl and <path>.host.intr. Leading '@' stands for
+ * the abstract namespace. */
+static const char *local_path = NULL;
+
+void
+local_init (const char *path)
+{
+	local_path = path;
+}
+
+/* Fill in the socket address for given channel. Returns its length. */
+static socklen_t
+local_addr (struct sockaddr_un *addr, unsigned short psm, int host)
+{
+	int len;
+
+	memset (addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	len = snprintf (addr->sun_path, sizeof(addr->sun_path), "%s%s.%s",
+		local_path, host ? ".host" : "",
+		psm == L2CAP_PSM_HIDP_CTRL ? "ctrl" : "intr");
+	if (len >= sizeof(addr->sun_path))
+		len = sizeof(addr->sun_path) - 1;
+	/* Abstract names are not terminated */
+	if (local_path[0] == '@') {
+		addr->sun_path[0] = '\0';
+		return offsetof(struct sockaddr_un, sun_path) + len;
+	}
+
+	return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+static int
+local_listen (const bdaddr_t *bdaddr, unsigned short psm, int lm, int backlog)
+{
+	struct sockaddr_un addr;
+	socklen_t len;
+	int sk;
+
+	sk = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sk == -1) {
+		perror ("Cannot create a local server socket");
+		return -1;
+	}
+
+	len = local_addr (&addr, psm, 0);
+	if (addr.sun_path[0])
+		unlink (addr.sun_path);
+	if (bind (sk, (struct sockaddr *)&addr, len) == -1) {
+		perror ("Cannot bind a local server socket");
+		goto fail;
+	}
+
+	if (listen (sk, backlog) == -1) {
+		perror ("Cannot listen to a local server socket");
+		goto fail;
+	}
+
+	return sk;
+fail:
+	close (sk);
+	return -1;
+}
+
+/* Peers have no Bluetooth address. Call them all BDADDR_LOCAL, so that
+ * they can be told apart from no peer at all. */
+static int
+local_accept (int sk, bdaddr_t *bdaddr)
+{
+	int nsk;
+
+	nsk = accept (sk, NULL, NULL);
+	if (nsk == -1) {
+		perror ("Cannot accept a local connection");
+		return -1;
+	}
+
+	if (bdaddr)
+		bacpy (bdaddr, BDADDR_LOCAL);
+
+	return nsk;
+}
+
+static int
+local_connect (bdaddr_t *src, bdaddr_t *dst, unsigned short psm)
+{
+	struct sockaddr_un addr;
+	socklen_t len;
+	int sk;
+
+	sk = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sk == -1) {
+		perror ("Cannot create a local client socket");
+		return -1;
+	}
+
+	len = local_addr (&addr, psm, 1);
+	if (connect (sk, (struct sockaddr *)&addr, len) == -1 && errno != EINPROGRESS) {
+		perror ("Cannot connect a local client socket");
+		close (sk);
+		return -1;
+	}
+
+	return sk;
+}
+
+static int
+local_connected (int sk)
+{
+	int err;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt (sk, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+		perror ("Cannot get local connection status");
+		return -1;
+	}
+	if (err) {
+		errno = err;
+		perror ("Cannot connect a local client socket");
+		return -1;
+	}
+
+	if (fcntl (sk, F_SETFL, 0) == -1) {
+		perror ("Cannot make a local client socket blocking");
+		return -1;
+	}
+
+	return 0;
+}
+
+struct transport local_transport = {
+	.name = "local",
+	.listen = local_listen,
+	.accept = local_accept,
+	.connect = local_connect,
+	.connected = local_connected,
+	.adapter = 0,
+};
@@ -4,27 +4,77 @@
  * License: GPL
  */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <linux/input.h>
+
 #include "btkbdd.h"
 
+struct config config = {
+	.frames = 0,
+	.backlog = 10000,
+	.metrics = NULL,
+	.nkro = 0,
+	.uhid = 0,
+	.record = NULL,
+	.transport = &l2cap_transport,
+	.realtime = 0,
+	.priority = 0,
+	.cpus = NULL,
+	.watch = NULL,
+	.hotkey = 0,
+	.broadcast = 0,
+};
+
+/* Remember a host, unless it's known already.
+ * Returns -1 if there's no room for it. */
+static int
+add_host (tgt, addr)
+	bdaddr_t *tgt;
+	const char *addr;
+{
+	bdaddr_t ba;
+	int i;
+
+	str2ba (addr, &ba);
+	for (i = 0; i < HOSTS; i++) {
+		if (!bacmp (&tgt[i], &ba))
+			return 0;
+		if (!bacmp (&tgt[i], BDADDR_ANY)) {
+			bacpy (&tgt[i], &ba);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
 int
 main (argc, argv)
 	int argc;
 	char *argv[];
 {
 	char *cable = NULL;
-	bdaddr_t src, tgt;
+	char *quirks = NULL;
+	const struct quirks *profile = NULL;
+	bdaddr_t src, tgt[HOSTS];
 	int opt;
+	int ret;
+	int i;
 	FILE *cablef;
+	char *end;
+	long n;
 	char addr[] = "00:00:00:00:00:00";
 
 	bacpy (&src, BDADDR_ANY);
-	bacpy (&tgt, BDADDR_ANY);
+	for (i = 0; i < HOSTS; i++)
+		bacpy (&tgt[i], BDADDR_ANY);
 
-	while ((opt = getopt(argc, argv, "s:t:c:dv")) != -1) {
+	while ((opt = getopt(argc, argv, "s:t:c:q:b:m:L:R:p:a:D:k:Bnudfv")) != -1) {
 
 		switch (opt) {
 		case 's':
@@ -39,7 +89,11 @@ main (argc, argv)
 				fprintf (stderr, "%s: Not a valid bluetooth address\n", optarg);
 				return EXIT_FAILURE;
 			}
-			str2ba (optarg, &tgt);
+			if (add_host (tgt, optarg) == -1) {
+				fprintf (stderr, "%s: Too many hosts, at most %d are possible\n",
+					optarg, HOSTS);
+				return EXIT_FAILURE;
+			}
 			break;
 		case 'c':
 			cable = optarg;
@@ -48,14 +102,82 @@ main (argc, argv)
 				perror (cable);
 				break;
 			}
+			/* An address per line, for each host */
 			if (fscanf (cablef, "%17s", addr) != 1)
 				fprintf (stderr, "Cable addres could not be read, ignoring.\n");
+			else do {
+				if (bachk (addr) == -1)
+					fprintf (stderr, "%s: Not a valid bluetooth address\n", addr);
+				else if (add_host (tgt, addr) == -1)
+					fprintf (stderr, "%s: Too many hosts, at most %d are possible, ignoring.\n",
+						addr, HOSTS);
+			} while (fscanf (cablef, "%17s", addr) == 1);
 			fclose (cablef);
-			if (bachk (addr) == -1) {
-				fprintf (stderr, "%s: Not a valid bluetooth address\n", addr);
-			} else {
-				str2ba (addr, &tgt);
+			break;
+		case 'q':
+			profile = quirks_profile (optarg);
+			if (!profile) {
+				fprintf (stderr, "%s: Not a known host profile\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			config.frames = 1;
+			break;
+		case 'B':
+			config.broadcast = 1;
+			break;
+		case 'n':
+			config.nkro = 1;
+			break;
+		case 'u':
+			config.uhid = 1;
+			break;
+		case 'R':
+			config.record = optarg;
+			break;
+		case 'b':
+			n = strtol (optarg, &end, 10);
+			if (end == optarg || *end || n < 0 || n > INT_MAX) {
+				fprintf (stderr, "%s: Not a valid number of milliseconds\n", optarg);
+				return EXIT_FAILURE;
+			}
+			config.backlog = n;
+			break;
+		case 'm':
+			config.metrics = optarg;
+			break;
+		case 'p':
+			n = strtol (optarg, &end, 10);
+			if (end == optarg || *end || n < 1 || n > 99) {
+				fprintf (stderr, "%s: Not a valid real-time priority\n", optarg);
+				return EXIT_FAILURE;
 			}
+			config.priority = n;
+			config.realtime = 1;
+			break;
+		case 'a':
+			if (rt_cpus (optarg) == -1) {
+				fprintf (stderr, "%s: Not a valid processor list\n", optarg);
+				return EXIT_FAILURE;
+			}
+			config.cpus = optarg;
+			config.realtime = 1;
+			break;
+		case 'D':
+			config.watch = optarg;
+			break;
+		case 'k':
+			n = strtol (optarg, &end, 10);
+			if (end == optarg || *end || n <= 0 || n > KEY_MAX) {
+				fprintf (stderr, "%s: Not a valid key code\n", optarg);
+				return EXIT_FAILURE;
+			}
+			config.hotkey = n;
+			break;
+		case 'L':
+			local_init (optarg);
+			config.transport = &local_transport;
 			break;
 		case 'd':
 			if (daemon (0, 0) == -1) {
@@ -70,29 +192,45 @@ main (argc, argv)
 		}
 	}
 
-	if (optind + 1 != argc) {
+	if (optind == argc && !config.watch) {
 		fprintf (stderr, "Usage: %s "
 			"[-s <sr:c_:_a:dd:re:ss>] "
 			"[-t <de:st:_a:dd:re:ss>] "
-			"[-c <file>] [-d] <device>\n", argv[0]);
+			"[-c <file>] [-q <profile>] [-b <ms>] [-m <file>] [-L <path>] [-R <file>] "
+			"[-p <priority>] [-a <cpus>] [-D <dir>] [-k <code>] [-B] [-f] [-n] [-u] [-d] <device>...\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	/* Main loop */
-	loop (argv[optind], src, &tgt);
+	/* Host quirks are kept along with the cable */
+	if (cable) {
+		quirks = malloc (strlen (cable) + sizeof(".quirks"));
+		if (quirks)
+			sprintf (quirks, "%s.quirks", cable);
+	}
+	quirks_load (quirks, profile);
+
+	/* After daemon(), the locks are not inherited by the child */
+	if (config.realtime)
+		rt_lock ();
 
-	/* Store remote address */
+	/* Main loop. Returns on a fatal failure or a termination signal. */
+	ret = loop (&argv[optind], src, tgt) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	/* Store remote addresses */
 	if (cable) {
 		cablef = fopen (cable, "w");
 		if (cablef) {
-			ba2str (&tgt, addr);
-			fprintf (cablef, "%s\n", addr);
+			for (i = 0; i < HOSTS; i++) {
+				if (!bacmp (&tgt[i], BDADDR_ANY))
+					continue;
+				ba2str (&tgt[i], addr);
+				fprintf (cablef, "%s\n", addr);
+			}
 			fclose (cablef);
 		} else {
 			perror (cable);
 		}
 	}
 
-	/* Only returns on fatal failure */
-	return EXIT_FAILURE;
+	return ret;
 }
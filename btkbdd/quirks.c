@@ -0,0 +1,231 @@
+/*
+ * Per-host protocol quirks
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btkbdd.h"
+
+/* Known profiles. First one is the default for hosts we know nothing
+ * about, as it's the quickest to connect. Apple hosts are told apart
+ * by what they do, and switched to their own profile. */
+static const struct quirks profiles[] = {
+	{
+		/* Linux, Windows and the like do it by the book. */
+		.name = "generic",
+		.handshake = 0,
+		.delay = 0,
+		.boot = 0,
+		.leds = QUIRK_LEDS_STRICT,
+		.nkro = 1,
+	}, {
+		/* iPad & co. need a handshake and a delay after it,
+		 * and are sloppy about the LED report format. */
+		.name = "apple",
+		.handshake = 1,
+		.delay = 1000,
+		.boot = 0,
+		.leds = QUIRK_LEDS_ANY,
+		.nkro = 0,
+	}, {
+		/* Hosts that only understand the boot protocol
+		 * keyboard report. */
+		.name = "boot",
+		.handshake = 0,
+		.delay = 0,
+		.boot = 1,
+		.leds = QUIRK_LEDS_STRICT,
+		.nkro = 0,
+	},
+};
+
+/* Hosts we've seen */
+struct quirks_host {
+	bdaddr_t addr;
+	const struct quirks *quirks;
+};
+
+/* The list is changed by the input thread, and written out by the
+ * main one, if input has a thread of its own. The lock is only taken
+ * to change the list and to copy it out, never for the writing. */
+static struct quirks_host *hosts = NULL;
+static int nhosts = 0;
+static int changed = 0;		/* Not handed to quirks_save() yet */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char *quirks_file = NULL;
+static const struct quirks *quirks_default = &profiles[0];
+
+/* Look up a profile by name */
+const struct quirks *
+quirks_profile (name)
+	const char *name;
+{
+	int i;
+
+	for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+		if (strcmp (profiles[i].name, name) == 0)
+			return &profiles[i];
+	}
+
+	return NULL;
+}
+
+/* Remember the profile for a host, without saving */
+static const struct quirks *
+quirks_add (addr, quirks)
+	const bdaddr_t *addr;
+	const struct quirks *quirks;
+{
+	struct quirks_host *new;
+	int i;
+
+	pthread_mutex_lock (&lock);
+	for (i = 0; i < nhosts; i++) {
+		if (bacmp (&hosts[i].addr, addr) == 0) {
+			hosts[i].quirks = quirks;
+			goto out;
+		}
+	}
+
+	new = realloc (hosts, (nhosts + 1) * sizeof(*hosts));
+	if (!new) {
+		perror ("Could not remember host quirks");
+		goto out;
+	}
+	hosts = new;
+	bacpy (&hosts[nhosts].addr, addr);
+	hosts[nhosts].quirks = quirks;
+	nhosts++;
+out:
+	pthread_mutex_unlock (&lock);
+
+	return quirks;
+}
+
+/* Was the host list changed since the last call. The changes are
+ * not written out right away, so that the file is not in the way of
+ * a host connecting; call quirks_save() when there's time for it. */
+int
+quirks_changed ()
+{
+	int ret = changed;
+
+	changed = 0;
+	return ret && quirks_file;
+}
+
+/* Write the whole host list out */
+void
+quirks_save ()
+{
+	struct quirks_host *copy;
+	FILE *f;
+	char addr[18];
+	int count;
+	int i;
+
+	if (!quirks_file)
+		return;
+
+	pthread_mutex_lock (&lock);
+	count = nhosts;
+	copy = malloc (count * sizeof(*copy) + 1);	/* Even if there's none */
+	if (copy)
+		memcpy (copy, hosts, count * sizeof(*copy));
+	pthread_mutex_unlock (&lock);
+	if (!copy) {
+		perror ("Could not save host quirks");
+		return;
+	}
+
+	f = fopen (quirks_file, "w");
+	if (!f) {
+		perror (quirks_file);
+		free (copy);
+		return;
+	}
+	fprintf (f, "# Host quirk profiles: apple, generic or boot\n");
+	for (i = 0; i < count; i++) {
+		ba2str (&copy[i].addr, addr);
+		fprintf (f, "%s %s\n", addr, copy[i].quirks->name);
+	}
+	fclose (f);
+	free (copy);
+}
+
+/* Read the host list from a file. A missing file is fine,
+ * it will be created once we talk to a host. */
+void
+quirks_load (file, profile)
+	char *file;
+	const struct quirks *profile;
+{
+	FILE *f;
+	char line[256];
+	char addr[18], name[32];
+	bdaddr_t ba;
+	const struct quirks *quirks;
+
+	if (profile)
+		quirks_default = profile;
+	quirks_file = file;
+	if (!file)
+		return;
+
+	f = fopen (file, "r");
+	if (!f)
+		return;
+
+	while (fgets (line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf (line, "%17s %31s", addr, name) != 2 || bachk (addr) == -1) {
+			fprintf (stderr, "%s: Bad line ignored: %s", file, line);
+			continue;
+		}
+		quirks = quirks_profile (name);
+		if (!quirks) {
+			fprintf (stderr, "%s: Unknown profile '%s' ignored.\n", file, name);
+			continue;
+		}
+		str2ba (addr, &ba);
+		quirks_add (&ba, quirks);
+	}
+	fclose (f);
+}
+
+/* Profile for a host. The ones we see for the first time
+ * get the default one and are stored, so that it can be adjusted. */
+const struct quirks *
+quirks_get (addr)
+	const bdaddr_t *addr;
+{
+	int i;
+
+	for (i = 0; i < nhosts; i++) {
+		if (bacmp (&hosts[i].addr, addr) == 0)
+			return hosts[i].quirks;
+	}
+
+	quirks_add (addr, quirks_default);
+	changed = 1;
+
+	return quirks_default;
+}
+
+/* Change the profile of a host, once we've learned better */
+const struct quirks *
+quirks_set (addr, quirks)
+	const bdaddr_t *addr;
+	const struct quirks *quirks;
+{
+	quirks_add (addr, quirks);
+	changed = 1;
+
+	return quirks;
+}
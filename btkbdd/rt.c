@@ -0,0 +1,97 @@
+/*
+ * Real-time scheduling of the input thread
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#define _GNU_SOURCE
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "btkbdd.h"
+
+/* Stack touched in advance, more than the input path ever needs */
+#define RT_STACK	(64 * 1024)
+
+static cpu_set_t cpus;
+
+/* Parse a list of processors, such as "2" or "0-1,4", into the set
+ * the input thread is pinned to. Returns -1 if it's not a valid list. */
+int
+rt_cpus (list)
+	const char *list;
+{
+	char *end;
+	long first, last;
+
+	CPU_ZERO (&cpus);
+	do {
+		first = last = strtol (list, &end, 10);
+		if (end == list)
+			return -1;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol (list, &end, 10);
+			if (end == list)
+				return -1;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; first++)
+			CPU_SET (first, &cpus);
+		list = end + 1;
+	} while (*end == ',');
+
+	return *end ? -1 : 0;
+}
+
+/* Keep everything we have and will ever have in memory, so that no page
+ * fault sits in front of a key press. Freed memory is kept too, instead
+ * of being given back and faulted in again. */
+void
+rt_lock ()
+{
+	if (mlockall (MCL_CURRENT | MCL_FUTURE) == -1)
+		perror ("Could not lock the memory");
+	mallopt (M_TRIM_THRESHOLD, -1);
+	mallopt (M_MMAP_MAX, 0);
+}
+
+/* Called by the input thread itself. Failures are not fatal, it just
+ * runs as if it was not asked to. */
+void
+rt_thread ()
+{
+	struct sched_param param = { .sched_priority = config.priority };
+	volatile char stack[RT_STACK];
+	int ret;
+	int i;
+
+	if (config.cpus) {
+		ret = pthread_setaffinity_np (pthread_self (), sizeof(cpus), &cpus);
+		if (ret) {
+			fprintf (stderr, "Could not set the input thread affinity: %s\n",
+				strerror (ret));
+		}
+	}
+
+	if (config.priority) {
+		ret = pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+		if (ret) {
+			fprintf (stderr, "Could not make the input thread real-time: %s\n",
+				strerror (ret));
+		}
+	}
+
+	/* Fault the stack in, the frames of the event handlers
+	 * will reuse it */
+	for (i = 0; i < sizeof(stack); i += 1024)
+		stack[i] = 0;
+}
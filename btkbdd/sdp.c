@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/sdp.h>
 #include <bluetooth/sdp_lib.h>
@@ -24,9 +25,44 @@
 #include "apple.h"
 #endif
 
+/* A second keyboard with a bit for each usage, for N-key rollover.
+ * The modifiers are at their usual usages, 0xe0 to 0xe7. */
+static const uint8_t NkroDescriptor[] = {
+	0x05, 0x01,		// USAGE_PAGE (Generic Desktop)
+	0x09, 0x06,		// USAGE (Keyboard)
+	0xa1, 0x01,		// COLLECTION (Application)
+	0x85, 0x02,		//   REPORT_ID (2)
+	0x05, 0x07,		//   USAGE_PAGE (Keyboard)
+	0x19, 0x00,		//   USAGE_MINIMUM (0)
+	0x2a, 0xff, 0x00,	//   USAGE_MAXIMUM (255)
+	0x15, 0x00,		//   LOGICAL_MINIMUM (0)
+	0x25, 0x01,		//   LOGICAL_MAXIMUM (1)
+	0x75, 0x01,		//   REPORT_SIZE (1)
+	0x96, 0x00, 0x01,	//   REPORT_COUNT (256)
+	0x81, 0x02,		//   INPUT (Data,Var,Abs)
+	0xc0,			// END_COLLECTION
+};
+
 sdp_record_t *sdp_record = NULL;
 sdp_session_t *sdp_session;
 
+/*
+ *  the descriptor we present, with the N-key report if enabled
+ */
+const uint8_t *report_descriptor(int *len)
+{
+	static uint8_t desc[sizeof(ReportDescriptor) + sizeof(NkroDescriptor)];
+
+	memcpy(desc, ReportDescriptor, sizeof(ReportDescriptor));
+	*len = sizeof(ReportDescriptor);
+	if (config.nkro) {
+		memcpy(desc + *len, NkroDescriptor, sizeof(NkroDescriptor));
+		*len += sizeof(NkroDescriptor);
+	}
+
+	return desc;
+}
+
 /*
  *  100% taken from bluez-utils (sdptool)
  */
@@ -121,9 +157,9 @@ int sdp_set_add_access_protos(sdp_record_t *rec, const sdp_list_t *ap)
 }
 
 /*
- *  add keyboard descriptor
+ *  add keyboard descriptor, returns -1 if it could not be registered
  */
-void sdp_add_keyboard()
+int sdp_add_keyboard()
 {
 	sdp_list_t *svclass_id, *pfseq, *apseq, *root;
 	uuid_t root_uuid, hidkb_uuid, l2cap_uuid, hidp_uuid;
@@ -149,14 +185,14 @@ void sdp_add_keyboard()
 
 	if (!sdp_session) {
 		printf("%s: sdp_session invalid\n", (char*)__func__);
-		exit(-1);
+		return -1;
 	}
 	session = sdp_session;
 
 	sdp_record = sdp_record_alloc();
 	if (!sdp_record) {
 		perror("add_keyboard sdp_record_alloc: ");
-		exit(-1);
+		return -1;
 	}
 
 	memset((void*)sdp_record, 0, sizeof(sdp_record_t));
@@ -213,9 +249,8 @@ void sdp_add_keyboard()
 	dtds[0] = &dtd2;
 	values[0] = &hid_spec_type;
 	dtds[1] = &dtd_data;
-	values[1] = (uint8_t*)ReportDescriptor;
+	values[1] = (uint8_t*)report_descriptor(&leng[1]);
 	leng[0] = 0;
-	leng[1] = sizeof(ReportDescriptor);
 	hid_spec_lst = sdp_seq_alloc_with_length(dtds, values, leng, 2);
 	hid_spec_lst2 = sdp_data_alloc(SDP_SEQ8, hid_spec_lst);
 	sdp_attr_add(sdp_record, SDP_ATTR_HID_DESCRIPTOR_LIST, hid_spec_lst2);
@@ -235,8 +270,12 @@ void sdp_add_keyboard()
 
 	if (sdp_record_register(session, sdp_record, 0) < 0) {
 		printf("%s: HID Device (Keyboard) Service Record registration failed\n", (char*)__func__);
-		exit(-1);
+		sdp_record_free(sdp_record);
+		sdp_record = NULL;
+		return -1;
 	}
+
+	return 0;
 }
 
 void sdp_remove()
@@ -245,7 +284,10 @@ void sdp_remove()
 		return;
 	if (sdp_record && sdp_record_unregister(sdp_session, sdp_record)) {
 		printf("%s: HID Device (Keyboard) Service Record unregistration failed\n", (char*)__func__);
+		sdp_record_free(sdp_record);
 	}
+	/* Freed along with the registration */
+	sdp_record = NULL;
 
 	sdp_close(sdp_session);
 	sdp_session = NULL;
@@ -0,0 +1,253 @@
+/*
+ * Latency statistics and counters
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "btkbdd.h"
+#include "hid.h"
+
+/* Bucket n holds latencies below 2^n microseconds,
+ * but not the ones below 2^(n-1) */
+#define HIST_BUCKETS 32
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+static const char *stage_names[LAT_STAGES] = {
+	[LAT_READ] = "read",
+	[LAT_REPORT] = "report",
+	[LAT_SENT] = "sent",
+};
+
+static struct hist hist[LAT_STAGES];
+static int enabled = 0;
+
+/* Start measuring. Only makes sense if the event device timestamps
+ * come from the same clock as now_us(). */
+void
+lat_enable ()
+{
+	__atomic_store_n (&enabled, 1, __ATOMIC_RELAXED);
+}
+
+/* Account the time it took since the key event to reach a stage */
+void
+lat_record (stage, us)
+	int stage;
+	long long us;
+{
+	struct hist *h = &hist[stage];
+	int b;
+
+	if (!enabled)
+		return;
+	if (us < 0)
+		us = 0;
+
+	b = us ? 64 - __builtin_clzll (us) : 0;
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+
+	/* Only this thread writes them, but stats_write() may read
+	 * them from another one */
+	__atomic_store_n (&h->bucket[b], h->bucket[b] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n (&h->count, h->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n (&h->sum, h->sum + us, __ATOMIC_RELAXED);
+	if (us > h->max)
+		__atomic_store_n (&h->max, us, __ATOMIC_RELAXED);
+}
+
+/* Upper (exclusive) bound of the bucket
+ * the given fraction of samples falls into */
+static uint64_t
+percentile (h, fraction)
+	struct hist *h;
+	double fraction;
+{
+	uint64_t want = h->count * fraction;
+	uint64_t seen = 0;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen > want)
+			break;
+	}
+
+	return 1ULL << b;
+}
+
+/* Print the histograms out */
+void
+lat_dump (f)
+	FILE *f;
+{
+	struct hist *h;
+	int i, b;
+
+	if (!enabled) {
+		fprintf (f, "Latency measurement not available.\n");
+		return;
+	}
+
+	for (i = 0; i < LAT_STAGES; i++) {
+		h = &hist[i];
+		fprintf (f, "Event to %s: %llu samples", stage_names[i],
+			(unsigned long long)h->count);
+		if (!h->count) {
+			fprintf (f, "\n");
+			continue;
+		}
+		fprintf (f, ", avg %lluus, p50 <%lluus, p99 <%lluus, p99.9 <%lluus, max %lluus\n",
+			(unsigned long long)(h->sum / h->count),
+			(unsigned long long)percentile (h, 0.5),
+			(unsigned long long)percentile (h, 0.99),
+			(unsigned long long)percentile (h, 0.999),
+			(unsigned long long)h->max);
+		for (b = 0; b < HIST_BUCKETS; b++) {
+			if (h->bucket[b])
+				fprintf (f, "\t<%10lluus %llu\n", 1ULL << b,
+					(unsigned long long)h->bucket[b]);
+		}
+	}
+}
+
+struct counters counters;
+
+/* A counter that may be changing meanwhile */
+#define LOAD(counter) __atomic_load_n (&(counter), __ATOMIC_RELAXED)
+
+static const char *handshake_names[16] = {
+	[HIDP_HSHK_SUCCESSFUL] = "successful",
+	[HIDP_HSHK_NOT_READY] = "not_ready",
+	[HIDP_HSHK_ERR_INVALID_REPORT_ID] = "invalid_report_id",
+	[HIDP_HSHK_ERR_UNSUPPORTED_REQUEST] = "unsupported_request",
+	[HIDP_HSHK_ERR_INVALID_PARAMETER] = "invalid_parameter",
+	[HIDP_HSHK_ERR_UNKNOWN] = "unknown",
+	[HIDP_HSHK_ERR_FATAL] = "fatal",
+};
+
+static void
+counter (f, name, help, value)
+	FILE *f;
+	const char *name;
+	const char *help;
+	uint64_t value;
+{
+	fprintf (f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+		name, help, name, name, (unsigned long long)value);
+}
+
+/* Write the counters out in Prometheus text exposition format.
+ * The file is replaced atomically, so that it can be scraped anytime. */
+int
+stats_write (file)
+	const char *file;
+{
+	char tmp[PATH_MAX];
+	struct hist *h;
+	uint64_t seen;
+	FILE *f;
+	int i, b;
+
+	snprintf (tmp, sizeof(tmp), "%s.tmp", file);
+	f = fopen (tmp, "w");
+	if (!f) {
+		perror (tmp);
+		return -1;
+	}
+	/* Anything counted from now on marks them dirty again */
+	__atomic_exchange_n (&counters.dirty, 0, __ATOMIC_ACQ_REL);
+
+	counter (f, "btkbdd_events_read_total",
+		"Input events read from the event device.", LOAD(counters.events));
+	counter (f, "btkbdd_reports_total",
+		"Reports built from the input events.", LOAD(counters.reports));
+	counter (f, "btkbdd_reports_sent_total",
+		"Reports written to the interrupt channel.", LOAD(counters.sent));
+	counter (f, "btkbdd_report_bytes_sent_total",
+		"Bytes written to the interrupt channel.", LOAD(counters.bytes));
+	counter (f, "btkbdd_reports_dropped_total",
+		"Reports that were never delivered.", LOAD(counters.dropped));
+	counter (f, "btkbdd_send_stalls_total",
+		"Times the interrupt channel was not writable.", LOAD(counters.stalls));
+	fprintf (f, "# HELP btkbdd_send_stall_seconds_total Time the interrupt channel was not writable.\n"
+		"# TYPE btkbdd_send_stall_seconds_total counter\n"
+		"btkbdd_send_stall_seconds_total %.3f\n", LOAD(counters.stall_ms) / 1000.0);
+	counter (f, "btkbdd_reports_collapsed_total",
+		"Reports merged into a queued one while the link was congested.", LOAD(counters.collapsed));
+	fprintf (f, "# HELP btkbdd_reports_queued Reports waiting to be sent.\n"
+		"# TYPE btkbdd_reports_queued gauge\n"
+		"btkbdd_reports_queued %d\n", LOAD(counters.queued));
+	counter (f, "btkbdd_rollovers_total",
+		"Times more than six keys were held down at once.", LOAD(counters.rollovers));
+
+	fprintf (f, "# HELP btkbdd_handshakes_total Handshakes sent in reply to host requests.\n"
+		"# TYPE btkbdd_handshakes_total counter\n");
+	for (i = 0; i < 16; i++) {
+		if (handshake_names[i])
+			fprintf (f, "btkbdd_handshakes_total{result=\"%s\"} %llu\n",
+				handshake_names[i],
+				(unsigned long long)LOAD(counters.handshakes[i]));
+	}
+
+	counter (f, "btkbdd_connect_attempts_total",
+		"Outgoing connection attempts.", LOAD(counters.connects));
+	counter (f, "btkbdd_connect_failures_total",
+		"Outgoing connection attempts that failed.", LOAD(counters.connect_failures));
+	fprintf (f, "# HELP btkbdd_connect_seconds Time it took to connect to the host.\n"
+		"# TYPE btkbdd_connect_seconds summary\n"
+		"btkbdd_connect_seconds_sum %.3f\n"
+		"btkbdd_connect_seconds_count %llu\n",
+		LOAD(counters.connect_ms) / 1000.0,
+		(unsigned long long)LOAD(counters.connected));
+	counter (f, "btkbdd_accepts_total",
+		"Connections accepted from hosts.", LOAD(counters.accepts));
+	fprintf (f, "# HELP btkbdd_adapter_ready Whether the adapter is set up as a keyboard.\n"
+		"# TYPE btkbdd_adapter_ready gauge\n"
+		"btkbdd_adapter_ready %d\n", LOAD(counters.adapter));
+	counter (f, "btkbdd_adapter_failures_total",
+		"Adapter setup attempts that failed.", LOAD(counters.adapter_failures));
+	counter (f, "btkbdd_host_switches_total",
+		"Switches to another host with the hotkey.", LOAD(counters.switches));
+	fprintf (f, "# HELP btkbdd_host_up Hosts connected.\n"
+		"# TYPE btkbdd_host_up gauge\n"
+		"btkbdd_host_up %d\n", LOAD(counters.up));
+
+	if (LOAD(enabled)) {
+		fprintf (f, "# HELP btkbdd_latency_seconds Time since the kernel timestamped the key event.\n"
+			"# TYPE btkbdd_latency_seconds histogram\n");
+		for (i = 0; i < LAT_STAGES; i++) {
+			h = &hist[i];
+			seen = 0;
+			for (b = 0; b < HIST_BUCKETS; b++) {
+				seen += LOAD(h->bucket[b]);
+				fprintf (f, "btkbdd_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+					stage_names[i], (1ULL << b) / 1e6,
+					(unsigned long long)seen);
+			}
+			fprintf (f, "btkbdd_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+				"btkbdd_latency_seconds_sum{stage=\"%s\"} %g\n"
+				"btkbdd_latency_seconds_count{stage=\"%s\"} %llu\n",
+				stage_names[i], (unsigned long long)seen,
+				stage_names[i], LOAD(h->sum) / 1e6,
+				stage_names[i], (unsigned long long)seen);
+		}
+	}
+
+	if (fclose (f) != 0 || rename (tmp, file) == -1) {
+		perror (file);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Local sink: the reports we send to hosts, fed to the kernel via uhid,
+ * so that it creates an input device out of them
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/uhid.h>
+
+#include "btkbdd.h"
+#include "hid.h"
+
+#define UHID "/dev/uhid"
+
+static int
+uhid_write (fd, ev)
+	int fd;
+	struct uhid_event *ev;
+{
+	if (write (fd, ev, sizeof(*ev)) != sizeof(*ev)) {
+		perror ("Could not write to " UHID);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Create a device with the descriptor we publish over SDP */
+int
+uhid_open (name)
+	const char *name;
+{
+	struct uhid_event ev;
+	const uint8_t *desc;
+	int len;
+	int fd;
+
+	fd = open (UHID, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		perror (UHID);
+		return -1;
+	}
+
+	desc = report_descriptor (&len);
+
+	memset (&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf ((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "%s", name);
+	ev.u.create2.bus = BUS_VIRTUAL;
+	ev.u.create2.rd_size = len;
+	memcpy (ev.u.create2.rd_data, desc, len);
+
+	if (uhid_write (fd, &ev) == -1) {
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Send an input report, starting with the report ID */
+int
+uhid_input (fd, buf, len)
+	int fd;
+	const uint8_t *buf;
+	int len;
+{
+	struct uhid_event ev;
+
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = len;
+	memcpy (ev.u.input2.data, buf, len);
+
+	return uhid_write (fd, &ev);
+}
+
+/* Process a request from the kernel.
+ * Returns the LEDs if they were set, -1 otherwise. */
+int
+uhid_read (fd)
+	int fd;
+{
+	struct uhid_event ev;
+	struct uhid_event reply;
+
+	if (read (fd, &ev, sizeof(ev)) == -1) {
+		if (errno != EAGAIN)
+			perror ("Could not read from " UHID);
+		return -1;
+	}
+
+	memset (&reply, 0, sizeof(reply));
+	switch (ev.type) {
+	case UHID_OUTPUT:
+		if (ev.u.output.size == 2 && ev.u.output.data[0] == KEY_REPORT_ID)
+			return ev.u.output.data[1];
+		break;
+	case UHID_GET_REPORT:
+		/* We don't do those. Answer, so that the caller does not
+		 * need to wait for a timeout. */
+		reply.type = UHID_GET_REPORT_REPLY;
+		reply.u.get_report_reply.id = ev.u.get_report.id;
+		reply.u.get_report_reply.err = EIO;
+		uhid_write (fd, &reply);
+		break;
+	case UHID_SET_REPORT:
+		reply.type = UHID_SET_REPORT_REPLY;
+		reply.u.set_report_reply.id = ev.u.set_report.id;
+		reply.u.set_report_reply.err = EIO;
+		uhid_write (fd, &reply);
+		break;
+	}
+
+	return -1;
+}
+
+void
+uhid_close (fd)
+	int fd;
+{
+	struct uhid_event ev;
+
+	memset (&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_write (fd, &ev);
+	close (fd);
+}
@@ -0,0 +1,911 @@
+/*
+ * Keyboard load generator and benchmark for btkbdd and evmuxd
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "../evreplay/evrec.h"
+
+#define UINPUT "/dev/uinput"
+
+#define MAX_CHORD	10	/* Keys in a frame, at most */
+#define SETTLE		2000	/* Wait for outstanding output, in ms */
+
+/* Keys that are typed. Letters mostly, some space. */
+static const uint16_t keys[] = {
+	KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I,
+	KEY_J, KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R,
+	KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z,
+	KEY_SPACE, KEY_SPACE, KEY_SPACE, KEY_SPACE, KEY_SPACE,
+	KEY_DOT, KEY_COMMA, KEY_1, KEY_2, KEY_3,
+};
+#define NKEYS (sizeof(keys) / sizeof(keys[0]))
+
+/* Distributions of the gaps between key presses and of the time a key is
+ * held, as quantiles in percents of the mean, taken at each 10%. Typists
+ * roll over quickly between the keys they know well and stall before the
+ * ones they don't. */
+static const int gap_quantiles[11] = {
+	25, 45, 58, 68, 78, 88, 100, 115, 135, 170, 320,
+};
+static const int hold_quantiles[11] = {
+	55, 70, 78, 85, 92, 98, 105, 112, 122, 140, 200,
+};
+
+/* A key event that is to be injected */
+struct event {
+	long long when;		/* Due, in ns from the start */
+	uint16_t code;
+	int value;
+};
+
+/* Events that are injected at once, followed by a SYN_REPORT */
+struct frame {
+	long long when;		/* Due, in ns from the start */
+	long long sent;		/* When was it injected, in ns */
+	int first;		/* Index of the first event */
+	int count;
+	long long done;		/* Output count once it's all through */
+};
+
+static struct {
+	const char *name;
+	struct event *event;
+	int nevents;
+	struct frame *frame;
+	int nframes;
+	int keystrokes;		/* Key presses */
+} load;
+
+static uint64_t seed = 1;
+
+/* xorshift64*, so that the runs are reproducible everywhere */
+static uint64_t
+rnd (void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545f4914f6cdd1dULL;
+}
+
+/* Random number in given range */
+static int
+rnd_range (int min, int max)
+{
+	return min + rnd () % (max - min + 1);
+}
+
+/* Random value of a distribution given by its deciles */
+static long long
+rnd_quantile (const int *quantiles, long long mean)
+{
+	int frac = rnd () % 1000;
+	int d = frac / 100;
+	int q = quantiles[d] * 100 + (quantiles[d + 1] - quantiles[d]) * (frac % 100);
+
+	return mean * q / 10000;
+}
+
+static long long
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+add_event (long long when, uint16_t code, int value)
+{
+	struct event *event = &load.event[load.nevents++];
+
+	event->when = when;
+	event->code = code;
+	event->value = value;
+	if (value == 1)
+		load.keystrokes++;
+}
+
+static int
+event_cmp (const void *a, const void *b)
+{
+	const struct event *ea = a, *eb = b;
+
+	if (ea->when != eb->when)
+		return ea->when < eb->when ? -1 : 1;
+	/* Keep a key's press before its release */
+	return eb->value - ea->value;
+}
+
+/* Typing at given words per minute, a word being five characters and
+ * a space. Some of the keys are shifted. */
+static void
+load_wpm (int count, int wpm)
+{
+	long long gap = 60000000000LL / (wpm * 6);
+	long long held[KEY_CNT] = { 0, };
+	long long t = 0, hold;
+	uint16_t code;
+	int i;
+
+	load.event = calloc (count * 4, sizeof(struct event));
+	for (i = 0; i < count; i++) {
+		t += rnd_quantile (gap_quantiles, gap);
+		hold = rnd_quantile (hold_quantiles, 100000000LL);
+
+		/* Not a key that is still being held */
+		do {
+			code = keys[rnd () % NKEYS];
+		} while (held[code] > t);
+		held[code] = t + hold;
+
+		if (rnd () % 100 < 8 && held[KEY_LEFTSHIFT] < t - 20000000LL) {
+			add_event (t - 20000000LL, KEY_LEFTSHIFT, 1);
+			add_event (t + hold + 10000000LL, KEY_LEFTSHIFT, 0);
+			held[KEY_LEFTSHIFT] = t + hold + 10000000LL;
+		}
+		add_event (t, code, 1);
+		add_event (t + hold, code, 0);
+	}
+}
+
+/* Many keys at once, pressed and released together */
+static void
+load_chords (int count, int rate)
+{
+	long long gap = 1000000000LL / rate;
+	long long t = 0;
+	int chord[MAX_CHORD];
+	int i, j, k, n;
+
+	load.event = calloc (count * 2, sizeof(struct event));
+	for (i = 0; i < count; i += n) {
+		n = rnd_range (2, MAX_CHORD);
+		if (n > count - i)
+			n = count - i;
+
+		/* Distinct keys */
+		for (j = 0; j < n; j++) {
+			do {
+				chord[j] = rnd () % 26;
+				for (k = 0; k < j && chord[k] != chord[j]; k++);
+			} while (k < j);
+		}
+
+		for (j = 0; j < n; j++)
+			add_event (t, keys[chord[j]], 1);
+		for (j = 0; j < n; j++)
+			add_event (t + gap / 2, keys[chord[j]], 0);
+		t += gap;
+	}
+}
+
+/* Presses and releases as fast as they go through */
+static void
+load_burst (int count)
+{
+	int i;
+
+	load.event = calloc (count * 2, sizeof(struct event));
+	for (i = 0; i < count; i++) {
+		add_event (0, keys[i % 26], 1);
+		add_event (0, keys[i % 26], 0);
+	}
+}
+
+/* Key events of a recording, at the pace they were recorded.
+ * Events of a frame share the timestamp, so they stay together. */
+static int
+load_recording (const char *file)
+{
+	const struct evrec_record *rec;
+	long long t = 0;
+	size_t n, i;
+
+	rec = evrec_map (file, &n);
+	if (rec == NULL)
+		return -1;
+
+	load.event = calloc (n + 1, sizeof(struct event));
+	if (!load.event)
+		return -1;
+	for (i = 0; i < n; i++) {
+		t += rec[i].delta * 1000LL;
+		if (rec[i].type == EV_KEY)
+			add_event (t, rec[i].code, rec[i].value);
+	}
+
+	return 0;
+}
+
+/* Group the events into frames. All that happen at once go together,
+ * in a burst each event is a frame of its own. */
+static void
+load_frames (int per_event)
+{
+	int i;
+
+	qsort (load.event, load.nevents, sizeof(struct event), event_cmp);
+	load.frame = calloc (load.nevents, sizeof(struct frame));
+	for (i = 0; i < load.nevents; i++) {
+		if (per_event || !load.nframes
+			|| load.frame[load.nframes - 1].when != load.event[i].when
+			|| load.frame[load.nframes - 1].count == MAX_CHORD) {
+			load.frame[load.nframes].when = load.event[i].when;
+			load.frame[load.nframes].first = i;
+			load.nframes++;
+		}
+		load.frame[load.nframes - 1].count++;
+	}
+}
+
+static int
+open_uinput (const char *name)
+{
+	struct uinput_user_dev dev = { 0, };
+	int fd;
+	int i;
+
+	fd = open (UINPUT, O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror (UINPUT);
+		return -1;
+	}
+
+	if (ioctl (fd, UI_SET_EVBIT, EV_KEY) == -1) {
+		perror ("Could not enable key events");
+		goto fail;
+	}
+
+	/* No EV_REP, the kernel would repeat the held keys */
+	for (i = 0; i < KEY_CNT; i++) {
+		if (ioctl (fd, UI_SET_KEYBIT, i) == -1) {
+			perror ("Could not enable a key event");
+			goto fail;
+		}
+	}
+
+	strncpy (dev.name, name, UINPUT_MAX_NAME_SIZE - 1);
+	dev.id.bustype = BUS_VIRTUAL;
+	dev.id.vendor  = 0x0666;
+	dev.id.product = 0x8087;
+	dev.id.version = 1;
+
+	if (write (fd, &dev, sizeof (dev)) != sizeof (dev)) {
+		perror (UINPUT);
+		goto fail;
+	}
+
+	if (ioctl (fd, UI_DEV_CREATE) == -1) {
+		perror ("Could not create the virtual keyboard");
+		goto fail;
+	}
+
+	return fd;
+fail:
+	close (fd);
+	return -1;
+}
+
+/* Inject a frame */
+static int
+inject (int fd, struct frame *frame)
+{
+	struct input_event ev[MAX_CHORD + 1];
+	int i;
+
+	memset (ev, 0, sizeof(ev));
+	for (i = 0; i < frame->count; i++) {
+		ev[i].type = EV_KEY;
+		ev[i].code = load.event[frame->first + i].code;
+		ev[i].value = load.event[frame->first + i].value;
+	}
+	ev[i].type = EV_SYN;
+	ev[i].code = SYN_REPORT;
+
+	frame->sent = now_ns ();
+	if (write (fd, ev, (i + 1) * sizeof(ev[0])) != (i + 1) * sizeof(ev[0])) {
+		perror ("Could not inject events");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Wait for the event device node of an input device, such as "input12",
+ * to appear. */
+static int
+event_path (const char *sysname, char *path, size_t len)
+{
+	char dir[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+	int tries;
+
+	snprintf (dir, sizeof(dir), "/sys/class/input/%s", sysname);
+	for (tries = 0; tries < 500; tries++) {
+		d = opendir (dir);
+		while (d && (de = readdir (d))) {
+			if (strncmp (de->d_name, "event", 5) != 0)
+				continue;
+			snprintf (path, len, "/dev/input/%s", de->d_name);
+			closedir (d);
+			d = NULL;
+			if (access (path, R_OK | W_OK) == 0)
+				return 0;
+		}
+		if (d)
+			closedir (d);
+		usleep (10000);
+	}
+
+	fprintf (stderr, "%s: No event device showed up.\n", sysname);
+	return -1;
+}
+
+/* Newest input device of given name. Returns its number, -1 if none. */
+static int
+find_input (const char *name)
+{
+	char path[PATH_MAX];
+	char buf[UINPUT_MAX_NAME_SIZE];
+	struct dirent *de;
+	int found = -1, n;
+	DIR *d;
+	FILE *f;
+
+	d = opendir ("/sys/class/input");
+	if (!d)
+		return -1;
+
+	while ((de = readdir (d))) {
+		if (sscanf (de->d_name, "input%d", &n) != 1 || n <= found)
+			continue;
+		snprintf (path, sizeof(path), "/sys/class/input/%s/name", de->d_name);
+		f = fopen (path, "r");
+		if (!f)
+			continue;
+		if (fgets (buf, sizeof(buf), f) && strncmp (buf, name, strlen (name)) == 0
+			&& buf[strlen (name)] == '\n')
+			found = n;
+		fclose (f);
+	}
+	closedir (d);
+
+	return found;
+}
+
+/* Wait for a new input device of given name to show up */
+static int
+wait_input (const char *name, int old, char *path, size_t len)
+{
+	char sysname[32];
+	int n, tries;
+
+	for (tries = 0; tries < 500; tries++) {
+		n = find_input (name);
+		if (n > old) {
+			snprintf (sysname, sizeof(sysname), "input%d", n);
+			return event_path (sysname, path, len);
+		}
+		usleep (10000);
+	}
+
+	fprintf (stderr, "%s: Input device did not show up.\n", name);
+	return -1;
+}
+
+/* Read the output of evmuxd the way btkbdd does */
+static int
+open_input (const char *dev)
+{
+	int norepeat[2] = { 0, 0 };
+	int fd;
+
+	fd = open (dev, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		perror (dev);
+		return -1;
+	}
+
+	if (ioctl (fd, EVIOCGRAB, 1) == -1) {
+		perror ("Could not grab keyboard for exclusive use");
+		goto fail;
+	}
+
+	if (ioctl (fd, EVIOCSREP, norepeat) == -1) {
+		perror ("Could not disable autorepeat");
+		goto fail;
+	}
+
+	return fd;
+fail:
+	close (fd);
+	return -1;
+}
+
+/* Connect to a channel of btkbdd's local transport */
+static int
+connect_local (const char *name, const char *channel)
+{
+	struct sockaddr_un addr;
+	socklen_t len;
+	int fd;
+	int tries;
+
+	memset (&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	len = snprintf (addr.sun_path, sizeof(addr.sun_path), "@%s.%s", name, channel);
+	addr.sun_path[0] = '\0';
+	len += offsetof(struct sockaddr_un, sun_path);
+
+	for (tries = 0; tries < 500; tries++) {
+		fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (fd == -1) {
+			perror ("Could not create a socket");
+			return -1;
+		}
+		if (connect (fd, (struct sockaddr *)&addr, len) == 0) {
+			fcntl (fd, F_SETFL, O_NONBLOCK);
+			return fd;
+		}
+		close (fd);
+		if (errno != ECONNREFUSED && errno != ENOENT)
+			break;
+		usleep (10000);
+	}
+
+	perror ("Could not connect to btkbdd");
+	return -1;
+}
+
+/* Processes under test */
+struct child {
+	const char *name;
+	pid_t pid;
+	unsigned long long ticks;	/* utime + stime */
+	unsigned long long rwcalls;	/* read and write family calls */
+	unsigned long long switches;	/* context switches */
+};
+
+static pid_t
+spawn (char *const argv[])
+{
+	pid_t pid;
+
+	pid = fork ();
+	switch (pid) {
+	case -1:
+		perror ("fork");
+		break;
+	case 0:
+		execvp (argv[0], argv);
+		perror (argv[0]);
+		_exit (127);
+	}
+
+	return pid;
+}
+
+/* Take a snapshot of the resources a child used so far */
+static void
+child_stat (struct child *child)
+{
+	char path[64], line[256];
+	unsigned long long utime, stime, n;
+	char *p;
+	FILE *f;
+
+	child->ticks = child->rwcalls = child->switches = 0;
+
+	snprintf (path, sizeof(path), "/proc/%d/stat", child->pid);
+	f = fopen (path, "r");
+	if (f) {
+		/* The command name may contain anything but a ')' */
+		if (fgets (line, sizeof(line), f) && (p = strrchr (line, ')'))
+			&& sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+				&utime, &stime) == 2)
+			child->ticks = utime + stime;
+		fclose (f);
+	}
+
+	snprintf (path, sizeof(path), "/proc/%d/io", child->pid);
+	f = fopen (path, "r");
+	if (f) {
+		while (fgets (line, sizeof(line), f)) {
+			if (sscanf (line, "syscr: %llu", &n) == 1
+				|| sscanf (line, "syscw: %llu", &n) == 1)
+				child->rwcalls += n;
+		}
+		fclose (f);
+	}
+
+	snprintf (path, sizeof(path), "/proc/%d/status", child->pid);
+	f = fopen (path, "r");
+	if (f) {
+		while (fgets (line, sizeof(line), f)) {
+			if (sscanf (line, "voluntary_ctxt_switches: %llu", &n) == 1
+				|| sscanf (line, "nonvoluntary_ctxt_switches: %llu", &n) == 1)
+				child->switches += n;
+		}
+		fclose (f);
+	}
+}
+
+static void
+child_stop (struct child *child)
+{
+	if (child->pid <= 0)
+		return;
+	kill (child->pid, SIGTERM);
+	waitpid (child->pid, NULL, 0);
+	child->pid = 0;
+}
+
+/* Where the output is read from */
+#define OUT_REPORTS	0	/* HIDP reports from btkbdd */
+#define OUT_EVENTS	1	/* Frames from evmuxd */
+
+/* Count the output that came through. Returns -1 on error. */
+static int
+drain (int fd, int kind, long long *received)
+{
+	uint8_t buf[64];
+	struct input_event ev[64];
+	ssize_t len;
+	int i;
+
+	while (1) {
+		if (kind == OUT_REPORTS)
+			len = read (fd, buf, sizeof(buf));
+		else
+			len = read (fd, ev, sizeof(ev));
+		if (len == -1 && errno == EAGAIN)
+			return 0;
+		if (len <= 0) {
+			perror ("Could not read the output");
+			return -1;
+		}
+
+		if (kind == OUT_REPORTS) {
+			/* Input reports only */
+			if (buf[0] == 0xa1)
+				(*received)++;
+			continue;
+		}
+
+		for (i = 0; i < len / sizeof(ev[0]); i++) {
+			if (ev[i].type == EV_SYN && ev[i].code == SYN_REPORT)
+				(*received)++;
+		}
+	}
+}
+
+static int
+ll_cmp (const void *a, const void *b)
+{
+	const long long *la = a, *lb = b;
+
+	return *la < *lb ? -1 : *la > *lb;
+}
+
+static void
+usage (const char *name)
+{
+	fprintf (stderr, "Usage: %s [-t btkbdd|evmuxd|chain] [-w wpm|chord|burst] "
+		"[-n <keystrokes>] [-r <rate>] [-W <events>] [-S <seed>] "
+		"[-R <recording>] [-B <btkbdd>] [-E <evmuxd>] [-f] [-N]\n", name);
+}
+
+int
+main (int argc, char *argv[])
+{
+	const char *target = "btkbdd";
+	const char *workload = "wpm";
+	const char *btkbdd = "btkbdd";
+	const char *evmuxd = "evmuxd";
+	const char *record = NULL;
+	int count = 2000, rate = 0, window = 32;
+	int frames = 0, nkro = 0;
+	char sysname[32], dev[PATH_MAX], mux[PATH_MAX], sock[64];
+	struct child child[2] = { { "btkbdd", 0 }, { "evmuxd", 0 } };
+	struct child before[2];
+	char *args[12];
+	int uinput = -1, ctrl = -1, out = -1;
+	int kind, per_frame;
+	long long received = 0, start, last, progress;
+	long long *lat;
+	int sent = 0, done = 0, outstanding = 0;
+	long tck = sysconf (_SC_CLK_TCK);
+	struct pollfd pfd[2];
+	int ret = 1;
+	int i, n, old, opt;
+
+	while ((opt = getopt (argc, argv, "t:w:n:r:W:S:B:E:R:fN")) != -1) {
+		switch (opt) {
+		case 't':
+			target = optarg;
+			break;
+		case 'w':
+			workload = optarg;
+			break;
+		case 'n':
+			count = atoi (optarg);
+			break;
+		case 'r':
+			rate = atoi (optarg);
+			break;
+		case 'W':
+			window = atoi (optarg);
+			break;
+		case 'S':
+			seed = strtoull (optarg, NULL, 0) | 1;
+			break;
+		case 'B':
+			btkbdd = optarg;
+			break;
+		case 'E':
+			evmuxd = optarg;
+			break;
+		case 'R':
+			record = optarg;
+			workload = "replay";
+			break;
+		case 'f':
+			frames = 1;
+			break;
+		case 'N':
+			nkro = 1;
+			break;
+		default:
+			usage (argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc || count <= 0 || window <= MAX_CHORD) {
+		usage (argv[0]);
+		return 1;
+	}
+
+	/* Prepare the whole load upfront, so that generating it
+	 * does not skew the timing */
+	load.name = workload;
+	if (record) {
+		if (load_recording (record) == -1)
+			return 1;
+		load_frames (0);
+	} else if (strcmp (workload, "wpm") == 0) {
+		load_wpm (count, rate ? rate : 80);
+		load_frames (0);
+	} else if (strcmp (workload, "chord") == 0) {
+		load_chords (count, rate ? rate : 20);
+		load_frames (0);
+	} else if (strcmp (workload, "burst") == 0) {
+		load_burst (count);
+		load_frames (1);
+	} else {
+		fprintf (stderr, "%s: Unknown workload.\n", workload);
+		return 1;
+	}
+	if (!load.event || !load.frame) {
+		perror ("Could not prepare the load");
+		return 1;
+	}
+
+	signal (SIGPIPE, SIG_IGN);
+
+	uinput = open_uinput ("btkbench");
+	if (uinput == -1)
+		return 1;
+	if (ioctl (uinput, UI_GET_SYSNAME(sizeof(sysname)), sysname) == -1) {
+		perror ("Could not get the virtual keyboard name");
+		goto out;
+	}
+	if (event_path (sysname, dev, sizeof(dev)) == -1)
+		goto out;
+
+	/* Start the processes under test */
+	if (strcmp (target, "evmuxd") == 0 || strcmp (target, "chain") == 0) {
+		old = find_input ("evmuxd primary");
+		args[0] = (char *)evmuxd;
+		args[1] = dev;
+		args[2] = NULL;
+		child[1].pid = spawn (args);
+		if (child[1].pid == -1)
+			goto out;
+		if (wait_input ("evmuxd primary", old, mux, sizeof(mux)) == -1)
+			goto out;
+	} else if (strcmp (target, "btkbdd") != 0) {
+		fprintf (stderr, "%s: Unknown target.\n", target);
+		goto out;
+	}
+
+	if (strcmp (target, "evmuxd") == 0) {
+		kind = OUT_EVENTS;
+		out = open_input (mux);
+		if (out == -1)
+			goto out;
+	} else {
+		kind = OUT_REPORTS;
+		snprintf (sock, sizeof(sock), "@btkbench-%d", getpid ());
+		n = 0;
+		args[n++] = (char *)btkbdd;
+		args[n++] = "-L";
+		args[n++] = sock;
+		args[n++] = "-q";
+		args[n++] = "generic";
+		args[n++] = "-b";
+		args[n++] = "0";
+		if (frames)
+			args[n++] = "-f";
+		if (nkro)
+			args[n++] = "-n";
+		args[n++] = child[1].pid ? mux : dev;
+		args[n++] = NULL;
+		child[0].pid = spawn (args);
+		if (child[0].pid == -1)
+			goto out;
+
+		/* Act as the host. The control channel comes first. */
+		ctrl = connect_local (sock + 1, "ctrl");
+		if (ctrl == -1)
+			goto out;
+		usleep (100000);
+		out = connect_local (sock + 1, "intr");
+		if (out == -1)
+			goto out;
+		usleep (100000);
+	}
+
+	/* What comes out for each frame */
+	per_frame = kind == OUT_EVENTS || frames;
+	for (i = 0; i < load.nframes; i++) {
+		received += per_frame ? 1 : load.frame[i].count;
+		load.frame[i].done = received;
+	}
+	received = 0;
+
+	pfd[0].fd = out;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ctrl;
+	pfd[1].events = POLLIN;
+
+	for (i = 0; i < 2; i++) {
+		if (child[i].pid)
+			child_stat (&child[i]);
+		before[i] = child[i];
+	}
+
+	start = last = progress = now_ns ();
+	while (done < load.nframes) {
+		/* Inject what's due, as long as the window allows */
+		while (sent < load.nframes
+			&& now_ns () - start >= load.frame[sent].when
+			&& outstanding + load.frame[sent].count <= window) {
+			if (inject (uinput, &load.frame[sent]) == -1)
+				goto out;
+			outstanding += load.frame[sent].count;
+			progress = load.frame[sent].sent;
+			sent++;
+		}
+
+		/* Sleep until the next frame is due or output arrives */
+		n = -1;
+		if (sent < load.nframes && outstanding + load.frame[sent].count <= window) {
+			n = (load.frame[sent].when - (now_ns () - start)) / 1000000;
+			if (n < 0)
+				n = 0;
+		}
+		if (n == -1 || n > SETTLE)
+			n = SETTLE;
+
+		if (poll (pfd, ctrl == -1 ? 1 : 2, n) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror ("poll");
+			goto out;
+		}
+
+		/* Whatever the host is told on the control channel */
+		if (ctrl != -1 && pfd[1].revents) {
+			uint8_t buf[64];
+			if (read (ctrl, buf, sizeof(buf)) <= 0) {
+				fprintf (stderr, "btkbdd hung up.\n");
+				goto out;
+			}
+		}
+
+		if (pfd[0].revents) {
+			if (drain (out, kind, &received) == -1)
+				goto out;
+			last = progress = now_ns ();
+			while (done < sent && received >= load.frame[done].done) {
+				load.frame[done].when = last - load.frame[done].sent;
+				outstanding -= load.frame[done].count;
+				done++;
+			}
+		} else if (done < sent && now_ns () - progress > SETTLE * 1000000LL) {
+			fprintf (stderr, "Output stalled, %d frames lost.\n", sent - done);
+			break;
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (child[i].pid)
+			child_stat (&child[i]);
+	}
+
+	if (done == 0) {
+		fprintf (stderr, "Nothing came through.\n");
+		goto out;
+	}
+
+	/* The "when" of each finished frame now holds its latency */
+	lat = malloc (done * sizeof(*lat));
+	if (!lat) {
+		perror ("malloc");
+		goto out;
+	}
+	for (i = 0; i < done; i++)
+		lat[i] = load.frame[i].when;
+	qsort (lat, done, sizeof(*lat), ll_cmp);
+
+	printf ("%s: %s, %d keystrokes in %d frames, %.3f s, %.1f keystrokes/s\n",
+		target, load.name, load.keystrokes, done,
+		(last - start) / 1e9, load.keystrokes / ((last - start) / 1e9));
+	printf ("latency: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+		lat[done / 2] / 1e3, lat[done * 99 / 100] / 1e3,
+		lat[done * 999 / 1000] / 1e3, lat[done - 1] / 1e3);
+	for (i = 0; i < 2; i++) {
+		if (!child[i].pid)
+			continue;
+		printf ("%s: cpu %.1f ms, %.2f us/keystroke, "
+			"%.2f read/write calls/keystroke, %.2f context switches/keystroke\n",
+			child[i].name,
+			(child[i].ticks - before[i].ticks) * 1000.0 / tck,
+			(child[i].ticks - before[i].ticks) * 1e6 / tck / load.keystrokes,
+			(double)(child[i].rwcalls - before[i].rwcalls) / load.keystrokes,
+			(double)(child[i].switches - before[i].switches) / load.keystrokes);
+	}
+	free (lat);
+
+	ret = done == load.nframes ? 0 : 1;
+out:
+	if (out != -1)
+		close (out);
+	if (ctrl != -1)
+		close (ctrl);
+	for (i = 0; i < 2; i++)
+		child_stop (&child[i]);
+	if (uinput != -1) {
+		ioctl (uinput, UI_DEV_DESTROY);
+		close (uinput);
+	}
+
+	return ret;
+}
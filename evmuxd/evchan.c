@@ -0,0 +1,320 @@
+/*
+ * Event channel: input events passed through shared memory
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "evchan.h"
+
+static int
+evchan_address (struct sockaddr_un *addr, const char *path)
+{
+	memset (addr, 0, sizeof (*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen (path) >= sizeof (addr->sun_path)) {
+		fprintf (stderr, "%s: Path too long\n", path);
+		return -1;
+	}
+	strcpy (addr->sun_path, path);
+
+	return 0;
+}
+
+/* Producer: start listening for the consumer. Whatever is in the
+ * way, likely the socket of a previous run, is removed. */
+int
+evchan_listen (const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (evchan_address (&addr, path) == -1)
+		return -1;
+
+	sock = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (sock == -1) {
+		perror ("Could not create a socket");
+		return -1;
+	}
+
+	unlink (path);
+	if (bind (sock, (struct sockaddr *)&addr, sizeof (addr)) == -1
+		|| listen (sock, 1) == -1) {
+		perror (path);
+		close (sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/* Producer: set up a new channel for the consumer that connected,
+ * and hand it over. */
+int
+evchan_accept (struct evchan *chan, int sock, int clock)
+{
+	struct evchan_hello hello;
+	char control[CMSG_SPACE (2 * sizeof (int))];
+	struct iovec iov = { &hello, sizeof (hello) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof (control),
+	};
+	struct cmsghdr *cmsg;
+	int memfd = -1;
+
+	chan->ring = NULL;
+	chan->wake = -1;
+	chan->tail = 0;
+	chan->overrun = 0;
+	chan->conn = accept4 (sock, NULL, NULL, SOCK_CLOEXEC);
+	if (chan->conn == -1) {
+		perror ("Could not accept a connection");
+		return -1;
+	}
+
+	/* Sealed, so that the consumer can't pull it from under us */
+	memfd = memfd_create ("evchan", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd == -1 || ftruncate (memfd, sizeof (struct evchan_ring)) == -1
+		|| fcntl (memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+		perror ("Could not create the shared memory");
+		goto fail;
+	}
+	chan->ring = mmap (NULL, sizeof (struct evchan_ring), PROT_READ | PROT_WRITE,
+		MAP_SHARED, memfd, 0);
+	if (chan->ring == MAP_FAILED) {
+		chan->ring = NULL;
+		perror ("Could not map the shared memory");
+		goto fail;
+	}
+	chan->wake = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (chan->wake == -1) {
+		perror ("Could not create an eventfd");
+		goto fail;
+	}
+
+	memset (&hello, 0, sizeof (hello));
+	memcpy (hello.magic, EVCHAN_MAGIC, sizeof (hello.magic));
+	hello.version = EVCHAN_VERSION;
+	hello.size = sizeof (struct input_event);
+	hello.events = EVCHAN_SIZE;
+	hello.clock = clock;
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (2 * sizeof (int));
+	memcpy (CMSG_DATA (cmsg), (int[]){ memfd, chan->wake }, 2 * sizeof (int));
+	if (sendmsg (chan->conn, &msg, MSG_NOSIGNAL) != sizeof (hello)) {
+		perror ("Could not hand the event channel over");
+		goto fail;
+	}
+
+	close (memfd);
+	return 0;
+fail:
+	if (memfd != -1)
+		close (memfd);
+	evchan_close (chan);
+	return -1;
+}
+
+/* Producer: add an event to the frame being put together. Returns -1
+ * if the consumer is too far behind for it to fit. */
+int
+evchan_put (struct evchan *chan, const struct input_event *event)
+{
+	struct evchan_ring *ring = chan->ring;
+
+	if (chan->overrun)
+		return -1;
+	if (chan->tail - __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) >= EVCHAN_SIZE) {
+		chan->overrun = 1;
+		return -1;
+	}
+
+	ring->event[chan->tail % EVCHAN_SIZE] = *event;
+	chan->tail++;
+	return 0;
+}
+
+/* Producer: make the frame visible to the consumer, and wake it up if
+ * it may have run out of events. A frame that did not fit is dropped
+ * as a whole, rather than have the consumer see a part of it. Returns
+ * the number of events published, -1 if they were dropped. */
+int
+evchan_publish (struct evchan *chan)
+{
+	struct evchan_ring *ring = chan->ring;
+	unsigned int last = ring->tail;
+	uint64_t one = 1;
+
+	if (chan->overrun) {
+		chan->tail = last;
+		chan->overrun = 0;
+		return -1;
+	}
+	if (chan->tail == last)
+		return 0;
+
+	/* Ordered against the consumer catching up: either it sees
+	 * the new tail, or we see that it has taken all there was. */
+	__atomic_store_n (&ring->tail, chan->tail, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&ring->head, __ATOMIC_SEQ_CST) == last
+		&& write (chan->wake, &one, sizeof (one)) != sizeof (one))
+		perror ("Could not wake the event channel consumer");
+
+	return chan->tail - last;
+}
+
+/* Consumer: connect to the producer and map the channel it gives us */
+int
+evchan_connect (struct evchan *chan, const char *path)
+{
+	struct sockaddr_un addr;
+	struct evchan_hello hello;
+	char control[CMSG_SPACE (2 * sizeof (int))];
+	struct iovec iov = { &hello, sizeof (hello) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof (control),
+	};
+	struct cmsghdr *cmsg;
+	int fds[2] = { -1, -1 };
+	struct stat st;
+	ssize_t len;
+
+	chan->ring = NULL;
+	chan->wake = -1;
+	chan->conn = -1;
+	if (evchan_address (&addr, path) == -1)
+		return -1;
+
+	chan->conn = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (chan->conn == -1 || connect (chan->conn, (struct sockaddr *)&addr, sizeof (addr)) == -1) {
+		perror (path);
+		goto fail;
+	}
+
+	len = recvmsg (chan->conn, &msg, MSG_CMSG_CLOEXEC);
+	cmsg = len == -1 ? NULL : CMSG_FIRSTHDR (&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+		&& cmsg->cmsg_len == CMSG_LEN (sizeof (fds)))
+		memcpy (fds, CMSG_DATA (cmsg), sizeof (fds));
+	if (len != sizeof (hello) || fds[1] == -1
+		|| memcmp (hello.magic, EVCHAN_MAGIC, sizeof (hello.magic))
+		|| hello.version != EVCHAN_VERSION
+		|| hello.size != sizeof (struct input_event)
+		|| hello.events != EVCHAN_SIZE) {
+		fprintf (stderr, "%s: Not a compatible event channel\n", path);
+		goto fail;
+	}
+
+	if (fstat (fds[0], &st) == -1 || st.st_size < sizeof (struct evchan_ring)) {
+		fprintf (stderr, "%s: Event channel too small\n", path);
+		goto fail;
+	}
+	chan->ring = mmap (NULL, sizeof (struct evchan_ring), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fds[0], 0);
+	if (chan->ring == MAP_FAILED) {
+		chan->ring = NULL;
+		perror ("Could not map the event channel");
+		goto fail;
+	}
+
+	close (fds[0]);
+	chan->wake = fds[1];
+	chan->clock = hello.clock;
+	return 0;
+fail:
+	if (fds[0] != -1)
+		close (fds[0]);
+	chan->wake = fds[1];
+	evchan_close (chan);
+	return -1;
+}
+
+/* Consumer: copy out as many of the published events as there are.
+ * The producer stores the tail before it looks at the head; here the
+ * head is stored before the tail is looked at again. Either it sees
+ * that we've caught up and wakes us, or we see what it has added. */
+static int
+evchan_take (struct evchan_ring *ring, struct input_event *event, int max)
+{
+	unsigned int head = ring->head;
+	unsigned int tail;
+	int n = 0;
+
+	for (;;) {
+		tail = __atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST);
+		if (head == tail || n == max)
+			return n;
+		while (head != tail && n < max)
+			event[n++] = ring->event[head++ % EVCHAN_SIZE];
+		__atomic_store_n (&ring->head, head, __ATOMIC_SEQ_CST);
+	}
+}
+
+/* Consumer: read up to max events. The eventfd stays readable for as
+ * long as there's anything left, so that it can be waited for with
+ * a level-triggered poll. Returns the number of events read, -1 on
+ * error. */
+int
+evchan_read (struct evchan *chan, struct input_event *event, int max)
+{
+	uint64_t n;
+	int count = 0;
+	int cleared = 0;
+
+	for (;;) {
+		count += evchan_take (chan->ring, event + count, max - count);
+		if (count == max) {
+			/* The rest is for the next time. Make sure
+			 * we're woken up for it. */
+			if (cleared && chan->ring->head != __atomic_load_n (&chan->ring->tail, __ATOMIC_SEQ_CST)
+				&& write (chan->wake, &(uint64_t){ 1 }, sizeof (n)) != sizeof (n))
+				return -1;
+			return count;
+		}
+		if (cleared)
+			return count;
+
+		/* Caught up. Take the wakeup, then look again for the
+		 * events it may have been for. */
+		if (read (chan->wake, &n, sizeof (n)) == -1 && errno != EAGAIN)
+			return -1;
+		cleared = 1;
+	}
+}
+
+void
+evchan_close (struct evchan *chan)
+{
+	if (chan->ring)
+		munmap (chan->ring, sizeof (struct evchan_ring));
+	if (chan->wake != -1)
+		close (chan->wake);
+	if (chan->conn != -1)
+		close (chan->conn);
+	chan->ring = NULL;
+	chan->wake = -1;
+	chan->conn = -1;
+}
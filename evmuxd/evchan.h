@@ -0,0 +1,61 @@
+/*
+ * Event channel: input events passed through shared memory
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#ifndef __EVCHAN_H
+#define __EVCHAN_H
+
+#include <stdint.h>
+#include <linux/input.h>
+
+/* A single producer passes events to a single consumer through a ring
+ * in a memfd, without either of them entering the kernel, other than
+ * to wake the consumer up with an eventfd when it may be asleep. The
+ * producer listens on a UNIX socket and hands both descriptors to
+ * whoever connects. The connection stays open, so that each side
+ * learns when the other one goes away. */
+#define EVCHAN_MAGIC	"EVCH"
+#define EVCHAN_VERSION	1
+
+#define EVCHAN_SIZE	1024		/* Events, must be a power of two */
+
+struct evchan_ring {
+	/* On lines of their own, so that the two sides don't keep
+	 * taking the cache line from each other */
+	unsigned int tail __attribute__((aligned(64)));	/* Written by the producer */
+	unsigned int head __attribute__((aligned(64)));	/* Written by the consumer */
+	struct input_event event[EVCHAN_SIZE] __attribute__((aligned(64)));
+};
+
+/* Sent along with the descriptors */
+struct evchan_hello {
+	char magic[4];
+	uint16_t version;
+	uint16_t size;		/* Of an event */
+	uint32_t events;	/* In the ring */
+	int32_t clock;		/* The event timestamps are of */
+};
+
+/* Either end of a channel */
+struct evchan {
+	struct evchan_ring *ring;	/* NULL if not connected */
+	int conn;		/* Connection between the two */
+	int wake;		/* eventfd, written by the producer */
+	unsigned int tail;	/* Producer: end of the frame not published yet */
+	int overrun;		/* Producer: the frame did not fit */
+	int clock;		/* Consumer: of the event timestamps */
+};
+
+int evchan_listen (const char *path);
+int evchan_accept (struct evchan *chan, int sock, int clock);
+int evchan_put (struct evchan *chan, const struct input_event *event);
+int evchan_publish (struct evchan *chan);
+
+int evchan_connect (struct evchan *chan, const char *path);
+int evchan_read (struct evchan *chan, struct input_event *event, int max);
+
+void evchan_close (struct evchan *chan);
+
+#endif
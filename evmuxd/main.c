@@ -3,12 +3,84 @@
 
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+#include "../evreplay/evrec.h"
+#include "evchan.h"
+#include "uring.h"
 
 #define UINPUT "/dev/uinput"
 
+/* How long after a change is the metrics file rewritten, in seconds */
+#define METRICS_INTERVAL 1
+
+/* Things worth counting */
+static struct {
+	unsigned long long events;	/* Read from the device */
+	unsigned long long forwarded;	/* Written to a virtual keyboard */
+	unsigned long long switches;	/* Of the active keyboard */
+	unsigned long long deferred;	/* Frames an output could not take right away */
+	unsigned long long dropped;	/* Frames that could not be taken at all */
+	int active;
+} counters;
+
+/* Write the counters out in Prometheus text exposition format.
+ * The file is replaced atomically, so that it can be scraped anytime. */
+static void
+write_metrics (const char *file)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	snprintf (tmp, sizeof (tmp), "%s.tmp", file);
+	f = fopen (tmp, "w");
+	if (f == NULL) {
+		perror (tmp);
+		return;
+	}
+
+	fprintf (f, "# HELP evmuxd_events_read_total Events read from the device.\n"
+		"# TYPE evmuxd_events_read_total counter\n"
+		"evmuxd_events_read_total %llu\n", counters.events);
+	fprintf (f, "# HELP evmuxd_events_forwarded_total Events written to the virtual keyboards.\n"
+		"# TYPE evmuxd_events_forwarded_total counter\n"
+		"evmuxd_events_forwarded_total %llu\n", counters.forwarded);
+	fprintf (f, "# HELP evmuxd_switches_total Switches of the active virtual keyboard.\n"
+		"# TYPE evmuxd_switches_total counter\n"
+		"evmuxd_switches_total %llu\n", counters.switches);
+	fprintf (f, "# HELP evmuxd_frames_deferred_total Frames held back until the output could take them.\n"
+		"# TYPE evmuxd_frames_deferred_total counter\n"
+		"evmuxd_frames_deferred_total %llu\n", counters.deferred);
+	fprintf (f, "# HELP evmuxd_frames_dropped_total Frames with no room or no one to take them.\n"
+		"# TYPE evmuxd_frames_dropped_total counter\n"
+		"evmuxd_frames_dropped_total %llu\n", counters.dropped);
+	fprintf (f, "# HELP evmuxd_active_output Index of the active virtual keyboard.\n"
+		"# TYPE evmuxd_active_output gauge\n"
+		"evmuxd_active_output %d\n", counters.active);
+
+	if (fclose (f) != 0 || rename (tmp, file) == -1)
+		perror (file);
+}
+
+static volatile sig_atomic_t quit = 0;
+
+static void
+terminate (int sig)
+{
+	quit = 1;
+}
+
 static int
 open_uinput (const char *name)
 {
@@ -109,64 +181,959 @@ fail:
 	return -1;
 }
 
-int
-main (int argc, char *argv[])
+/* Events read at once, at most */
+#define BATCH 64
+
+/* How often to try again to write what an output would not take, in ms */
+#define RETRY_INTERVAL 10
+
+/* A virtual keyboard, and the events it could not take yet. They're
+ * written before anything else is. */
+#define BACKLOG 256		/* Events, must be a power of two */
+struct output {
+	int fd;			/* -1 for the event channel */
+	struct input_event backlog[BACKLOG];
+	unsigned int head;	/* Next event to write */
+	unsigned int tail;	/* Next free slot */
+	uint32_t stale[KEY_CNT / 32];	/* Keys changed by the frames dropped */
+	int resync;		/* ...any of them */
+};
+
+/* Virtual keyboards, or the event channel, at most */
+#define OUTPUTS 8
+
+/* Everything the forwarding works with */
+static struct {
+	int input;
+	struct output output[OUTPUTS];
+	int outputs;
+	int active;
+	uint32_t keys[KEY_CNT / 32];	/* Held on the input */
+	char *metrics;
+	int timer;		/* Goes off when the metrics are due */
+	int due;		/* ...and is armed */
+	struct evrec rec;
+	char *channel;		/* Where the event channel is handed out */
+	int sock;		/* ...listening there */
+	struct evchan chan;
+	int clock;		/* Of the event timestamps */
+} mux;
+
+/* Something was done, have the metrics written out in a while, unless
+ * they're due already. Neither the clock nor the timer are bothered
+ * otherwise. Returns 1 if the timer was armed now. */
+static int
+metrics_arm ()
 {
-	int uinput[2], input;
-	struct input_event event;
-	int active = 0;
-	int switching = 0;
+	struct itimerspec its = { { 0, 0 }, { METRICS_INTERVAL, 0 } };
 
-	if (argc != 2) {
-		fprintf (stderr, "Usage: %s /dev/input/event<n>\n", argv[0]);
-		return 1;
+	if (mux.timer == -1 || mux.due)
+		return 0;
+	if (timerfd_settime (mux.timer, 0, &its, NULL) == -1) {
+		perror ("Could not set a timer");
+		return 0;
 	}
 
-	input = open_input (argv[1]);
-	if (input == -1)
-		return 1;
+	mux.due = 1;
+	return 1;
+}
 
-	uinput[0] = open_uinput ("evmuxd primary");
-	if (uinput[0] == -1)
-		return 1;
+/* The timer went off */
+static void
+metrics_due ()
+{
+	mux.due = 0;
+	write_metrics (mux.metrics);
+}
 
-	uinput[1] = open_uinput ("evmuxd secondary");
-	if (uinput[1] == -1)
-		return 1;
+/* Events read: the beginning of a frame left over from the previous
+ * read, followed by what was read now. Two of them for the io_uring
+ * engine, so that one is read into while the other is being written. */
+struct batch {
+	struct input_event event[2 * BATCH];
+	int count;
+	int writing;		/* Writes of its frames in progress */
+};
 
-	while (1) {
-		switch (read (input, &event, sizeof(event))) {
-		case -1:
-			perror ("Error reading from event device");
-			return 1;
-		case sizeof(event):
+static struct batch batch[2];
+
+/* Chords of keys that switch the outputs. The keys that are a part of
+ * any are numbered, so that the state of all of them, as well as each
+ * chord, fits a single word, and a key event is matched against the
+ * chords in a constant time. */
+#define CHORD_KEYS	64
+#define CHORD_CYCLE	OUTPUTS		/* Switches to the next output */
+
+static struct {
+	uint8_t index[KEY_CNT];		/* Number of a key, plus one; 0 if in no chord */
+	int keys;			/* Numbered so far */
+	uint64_t chord[OUTPUTS + 1];	/* Keys of the chord for each output, and the cycle */
+	uint32_t part[CHORD_KEYS];	/* Chords each key is a part of */
+	uint64_t down;			/* Keys held */
+	int armed;			/* Chord completed, -1 if none */
+} hot = { .armed = -1 };
+
+/* Parse keys, such as "70" or "29+2", into a chord. Returns -1 if
+ * it's not a valid one. */
+static int
+chord_parse (const char *keys, uint64_t *chord)
+{
+	char *end;
+	long code;
+
+	*chord = 0;
+	do {
+		code = strtol (keys, &end, 10);
+		if (end == keys || code <= 0 || code > KEY_MAX)
+			return -1;
+		if (!hot.index[code]) {
+			if (hot.keys == CHORD_KEYS)
+				return -1;
+			hot.index[code] = ++hot.keys;
+		}
+		*chord |= 1ULL << (hot.index[code] - 1);
+		keys = end + 1;
+	} while (*end == '+');
+
+	return *end ? -1 : 0;
+}
+
+/* Note which chords each key is a part of */
+static void
+chord_init ()
+{
+	int c, k;
+
+	for (c = 0; c <= OUTPUTS; c++) {
+		for (k = 0; k < CHORD_KEYS; k++) {
+			if (hot.chord[c] & 1ULL << k)
+				hot.part[k] |= 1 << c;
+		}
+	}
+}
+
+/* Keep track of the keys that are a part of the chords. Completing
+ * one arms the switch, the latest one completed wins. */
+static void
+chord_key (const struct input_event *event)
+{
+	uint64_t key;
+	uint32_t chords;
+	int c;
+
+	if (event->code > KEY_MAX || !hot.index[event->code])
+		return;
+	key = 1ULL << (hot.index[event->code] - 1);
+
+	if (event->value == 0) {
+		hot.down &= ~key;
+		return;
+	}
+	hot.down |= key;
+
+	for (chords = hot.part[hot.index[event->code] - 1]; chords; chords &= chords - 1) {
+		c = __builtin_ctz (chords);
+		if ((hot.down & hot.chord[c]) == hot.chord[c])
+			hot.armed = c;
+	}
+}
+
+/* Hold a frame, or what's left of it, back until the output takes it.
+ * One that doesn't fit is dropped whole, and the keys it changed are
+ * set right once the output catches up. */
+static void
+output_defer (struct output *out, const struct input_event *event, int count)
+{
+	int i;
+
+	if (!count)
+		return;
+	if (out->tail - out->head + count > BACKLOG) {
+		for (i = 0; i < count; i++) {
+			if (event[i].type != EV_KEY || event[i].code >= KEY_CNT)
+				continue;
+			out->stale[event[i].code / 32] |= 1U << event[i].code % 32;
+			out->resync = 1;
+		}
+		counters.dropped++;
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		out->backlog[out->tail++ % BACKLOG] = event[i];
+	counters.deferred++;
+}
+
+/* An output caught up after frames were dropped: hold back a frame of
+ * its own that tells it the state of the keys they changed. A key that
+ * is held on the input is pressed on the active output only, released
+ * on the others. Keys that don't fit are left for the next time. */
+static void
+output_resync (struct output *out)
+{
+	int active = out == &mux.output[mux.active];
+	struct input_event *event;
+	unsigned int code;
+
+	out->resync = 0;
+	for (code = 0; code < KEY_CNT; code++) {
+		if (!(out->stale[code / 32] & 1U << code % 32))
+			continue;
+		if (out->tail - out->head == BACKLOG - 1) {
+			out->resync = 1;
 			break;
-		default:
-			fprintf (stderr, "Short read from the event device.\n");
-			return 1;
 		}
+		out->stale[code / 32] &= ~(1U << code % 32);
+		event = &out->backlog[out->tail++ % BACKLOG];
+		memset (event, 0, sizeof (*event));
+		event->type = EV_KEY;
+		event->code = code;
+		event->value = active && mux.keys[code / 32] & 1U << code % 32;
+	}
 
-		switch (write (uinput[active], &event, sizeof(event))) {
-		case -1:
+	event = &out->backlog[out->tail++ % BACKLOG];
+	memset (event, 0, sizeof (*event));
+	event->type = EV_SYN;
+	event->code = SYN_REPORT;
+}
+
+/* Write what's held back for an output along with a new frame, in a
+ * single writev(). Whatever the output doesn't take is held back. */
+static int
+output_write (struct output *out, const struct input_event *event, int count)
+{
+	unsigned int head;
+	unsigned int held;
+	struct iovec iov[3];
+	int iovcnt = 0;
+	unsigned int done;
+	ssize_t len;
+
+	if (out->resync && out->head == out->tail)
+		output_resync (out);
+	head = out->head % BACKLOG;
+	held = out->tail - out->head;
+
+	/* The backlog can wrap around the end of the buffer */
+	if (held) {
+		iov[iovcnt].iov_base = &out->backlog[head];
+		iov[iovcnt++].iov_len = (head + held > BACKLOG ? BACKLOG - head : held)
+			* sizeof (struct input_event);
+		if (head + held > BACKLOG) {
+			iov[iovcnt].iov_base = &out->backlog[0];
+			iov[iovcnt++].iov_len = (head + held - BACKLOG) * sizeof (struct input_event);
+		}
+	}
+	if (count) {
+		iov[iovcnt].iov_base = (void *)event;
+		iov[iovcnt++].iov_len = count * sizeof (struct input_event);
+	}
+	if (!iovcnt)
+		return 0;
+
+	len = writev (out->fd, iov, iovcnt);
+	if (len == -1) {
+		if (errno != EAGAIN) {
 			perror ("Error forwarding the event");
+			return -1;
+		}
+		len = 0;
+	}
+	done = len / sizeof (struct input_event);
+	counters.forwarded += done;
+
+	if (done < held) {
+		out->head += done;
+		output_defer (out, event, count);
+	} else {
+		out->head = out->tail;
+		output_defer (out, event + done - held, count - (done - held));
+	}
+
+	return 0;
+}
+
+/* Retry the outputs with events held back. Returns 1 if any are left. */
+static int
+output_flush ()
+{
+	int left = 0;
+	int i;
+
+	for (i = 0; i < mux.outputs; i++) {
+		if (mux.output[i].head == mux.output[i].tail && !mux.output[i].resync)
+			continue;
+		if (output_write (&mux.output[i], NULL, 0) == -1)
+			return -1;
+		if (mux.output[i].head != mux.output[i].tail || mux.output[i].resync)
+			left = 1;
+	}
+
+	return left;
+}
+
+/* Does any output have events held back */
+static int
+output_held ()
+{
+	int i;
+
+	for (i = 0; i < mux.outputs; i++) {
+		if (mux.output[i].head != mux.output[i].tail || mux.output[i].resync)
 			return 1;
-		case sizeof(event):
+	}
+
+	return 0;
+}
+
+/* Pass an event to the consumer of the channel, a frame at a time */
+static void
+channel_write (struct evchan *chan, const struct input_event *event)
+{
+	int n;
+
+	if (event->type != EV_SYN || event->code != SYN_REPORT) {
+		if (chan->ring)
+			evchan_put (chan, event);
+		return;
+	}
+
+	if (!chan->ring) {
+		counters.dropped++;
+		return;
+	}
+	evchan_put (chan, event);
+	n = evchan_publish (chan);
+	if (n == -1)
+		counters.dropped++;
+	else
+		counters.forwarded += n;
+}
+
+/* Account for what was read into a batch. The length is negative
+ * errno on failure. */
+static int
+batch_read (struct batch *b, int len)
+{
+	if (len < 0) {
+		fprintf (stderr, "Error reading from event device: %s\n", strerror (-len));
+		return -1;
+	}
+	if (len == 0 || len % sizeof (struct input_event)) {
+		fprintf (stderr, "Short read from the event device.\n");
+		return -1;
+	}
+
+	b->count += len / sizeof (struct input_event);
+	return 0;
+}
+
+/* Pass a frame on to the active output. The switch happens after the
+ * frame that releases the last key of the chord. */
+static int
+forward_frame (struct batch *b, struct input_event *event, int count,
+	int (*write_frame) (struct batch *, struct output *, struct input_event *, int))
+{
+	struct output *out = &mux.output[mux.active];
+	int i;
+
+	counters.events += count;
+	evrec_write (&mux.rec, event, count);
+
+	for (i = 0; i < count; i++) {
+		if (event[i].type != EV_KEY || event[i].code >= KEY_CNT)
+			continue;
+		if (event[i].value)
+			mux.keys[event[i].code / 32] |= 1U << event[i].code % 32;
+		else
+			mux.keys[event[i].code / 32] &= ~(1U << event[i].code % 32);
+		chord_key (&event[i]);
+	}
+
+	if (out->fd == -1) {
+		for (i = 0; i < count; i++)
+			channel_write (&mux.chan, &event[i]);
+	} else if (write_frame (b, out, event, count) == -1) {
+		return -1;
+	}
+
+	if (event[count - 1].type == EV_SYN && hot.armed != -1
+		&& !(hot.down & hot.chord[hot.armed])) {
+		i = hot.armed == CHORD_CYCLE ? (mux.active + 1) % mux.outputs : hot.armed;
+		hot.armed = -1;
+		if (i != mux.active) {
+			mux.active = i;
+			counters.active = mux.active;
+			counters.switches++;
+			if (mux.metrics)
+				write_metrics (mux.metrics);
+		}
+	}
+
+	return 0;
+}
+
+/* Forward the whole frames of a batch, each with a single write. The
+ * beginning of a frame that's left is moved to the next batch, to be
+ * completed with the next read. */
+static int
+forward (struct batch *b, struct batch *next,
+	int (*write_frame) (struct batch *, struct output *, struct input_event *, int))
+{
+	int start = 0;
+	int i;
+
+	for (i = 0; i < b->count; i++) {
+		if (b->event[i].type != EV_SYN || b->event[i].code != SYN_REPORT)
+			continue;
+		if (forward_frame (b, &b->event[start], i + 1 - start, write_frame) == -1)
+			return -1;
+		start = i + 1;
+	}
+
+	/* Don't wait for the end of a frame that would not fit */
+	if (b->count - start >= BATCH) {
+		if (forward_frame (b, &b->event[start], b->count - start, write_frame) == -1)
+			return -1;
+		start = b->count;
+	}
+
+	next->count = b->count - start;
+	memmove (next->event, &b->event[start], next->count * sizeof (struct input_event));
+	return 0;
+}
+
+/* A new consumer of the event channel replaces the old one */
+static void
+channel_accept ()
+{
+	evchan_close (&mux.chan);
+	evchan_accept (&mux.chan, mux.sock, mux.clock);
+}
+
+static int
+write_plain (struct batch *b, struct output *out, struct input_event *event, int count)
+{
+	return output_write (out, event, count);
+}
+
+/* Forward with read() and writev() calls, waiting with poll() for the
+ * event channel consumer if there's one to be expected, or for the
+ * time to retry the outputs that were busy */
+static int
+run_plain ()
+{
+	struct batch *b = &batch[0];
+	struct pollfd pfd[4] = {
+		{ .fd = mux.input, .events = POLLIN },
+		{ .fd = mux.sock, .events = POLLIN },
+		{ .fd = -1, .events = POLLIN },
+		{ .fd = mux.timer, .events = POLLIN },
+	};
+	uint64_t n;
+	int held = 0;
+	ssize_t len;
+
+	while (!quit) {
+		if (mux.channel || held || mux.due) {
+			pfd[2].fd = mux.chan.conn;
+			if (poll (pfd, 4, held ? RETRY_INTERVAL : -1) == -1) {
+				if (errno == EINTR)
+					continue;
+				perror ("Error waiting for events");
+				return -1;
+			}
+			if (pfd[3].revents & POLLIN) {
+				if (read (mux.timer, &n, sizeof (n)) == -1)
+					perror ("Could not read the timer");
+				metrics_due ();
+				if (!pfd[0].revents && !pfd[1].revents && !pfd[2].revents && !held)
+					continue;
+			}
+			held = output_flush ();
+			if (held == -1)
+				return -1;
+			/* The consumer went away */
+			if (pfd[2].revents)
+				evchan_close (&mux.chan);
+			if (pfd[1].revents & POLLIN)
+				channel_accept ();
+			if (!pfd[0].revents) {
+				metrics_arm ();
+				continue;
+			}
+		}
+
+		len = read (mux.input, &b->event[b->count], BATCH * sizeof (struct input_event));
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (batch_read (b, len == -1 ? -errno : len) == -1)
+			return -1;
+		if (forward (b, b, write_plain) == -1)
+			return -1;
+		held = output_held ();
+		metrics_arm ();
+	}
+
+	return 0;
+}
+
+/* What a submission was, in the low byte of its user_data */
+#define OP_READ		1
+#define OP_WRITE	2	/* Batch, output and events above it */
+#define OP_ACCEPT	3
+#define OP_HANGUP	4	/* Channel generation above it */
+#define OP_CANCEL	5
+#define OP_RETRY	6
+#define OP_METRICS	7
+
+#define RING_ENTRIES	(BATCH + 8)
+
+static struct uring ring;
+static struct io_uring_sqe *chain;	/* Last write of the batch being forwarded */
+static int retrying;			/* Retry timeout submitted */
+static unsigned int generation;		/* Of the event channel */
+static uint64_t expirations;		/* Of the metrics timer, read into */
+
+/* An entry to submit, submitting the ones filled in so far to make room.
+ * That ends the chain of writes, whatever comes next starts a new one. */
+static struct io_uring_sqe *
+uring_get ()
+{
+	struct io_uring_sqe *sqe;
+
+	while (!(sqe = uring_sqe (&ring))) {
+		chain = NULL;
+		if (uring_enter (&ring, 0) == -1 && errno != EINTR) {
+			perror ("Could not submit to io_uring");
+			return NULL;
+		}
+	}
+
+	return sqe;
+}
+
+/* Have the metrics written out in a while. The timer is read along
+ * with whatever is submitted next. */
+static int
+uring_metrics ()
+{
+	struct io_uring_sqe *sqe;
+
+	if (!metrics_arm ())
+		return 0;
+
+	sqe = uring_get ();
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = mux.timer;
+	sqe->addr = (uintptr_t)&expirations;
+	sqe->len = sizeof (expirations);
+	sqe->off = -1;
+	sqe->user_data = OP_METRICS;
+
+	return 0;
+}
+
+/* Have the outputs with events held back retried in a while */
+static int
+uring_retry ()
+{
+	static struct __kernel_timespec ts = { 0, RETRY_INTERVAL * 1000000 };
+	struct io_uring_sqe *sqe = uring_get ();
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uintptr_t)&ts;
+	sqe->len = 1;		/* A single timespec */
+	sqe->off = 0;		/* Not counting completions, a pure timeout */
+	sqe->user_data = OP_RETRY;
+
+	return 0;
+}
+
+static int
+uring_poll (int fd, uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_get ();
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = data;
+
+	return 0;
+}
+
+/* A new consumer of the event channel replaces the old one, the wait
+ * for the old one to hang up is cancelled */
+static int
+uring_accept ()
+{
+	struct io_uring_sqe *sqe;
+
+	if (mux.chan.conn != -1) {
+		sqe = uring_get ();
+		if (!sqe)
+			return -1;
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = OP_HANGUP | (uint64_t)generation << 8;
+		sqe->user_data = OP_CANCEL;
+	}
+
+	channel_accept ();
+	generation++;
+	if (mux.chan.conn != -1 && uring_poll (mux.chan.conn, OP_HANGUP | (uint64_t)generation << 8) == -1)
+		return -1;
+
+	return uring_poll (mux.sock, OP_ACCEPT);
+}
+
+/* Handle the completions there are. Returns 1 if the read completed,
+ * with its result in res. */
+static int
+uring_reap (int *res)
+{
+	struct io_uring_cqe *cqe;
+	struct batch *b;
+	struct output *out;
+	struct input_event *event;
+	uint64_t data;
+	int result;
+	int count;
+	int done;
+	int ret = 0;
+
+	while ((cqe = uring_cqe (&ring))) {
+		data = cqe->user_data;
+		result = cqe->res;
+		uring_seen (&ring);
+
+		switch (data & 0xff) {
+		case OP_READ:
+			*res = result;
+			ret = 1;
+			break;
+		case OP_WRITE:
+			b = &batch[data >> 8 & 0xf];
+			out = &mux.output[data >> 12 & 0xf];
+			event = &b->event[data >> 16 & 0xffff];
+			count = data >> 32;
+			b->writing--;
+			/* The output is busy, or the write before this one
+			 * did not go through */
+			if (result == -EAGAIN || result == -ECANCELED)
+				result = 0;
+			if (result < 0) {
+				fprintf (stderr, "Error forwarding the event: %s\n", strerror (-result));
+				return -1;
+			}
+			done = result / sizeof (struct input_event);
+			counters.forwarded += done;
+			output_defer (out, event + done, count - done);
+			break;
+		case OP_METRICS:
+			metrics_due ();
+			break;
+		case OP_RETRY:
+			retrying = 0;
+			if (output_flush () == -1 || uring_metrics () == -1)
+				return -1;
+			break;
+		case OP_ACCEPT:
+			if (uring_accept () == -1)
+				return -1;
+			break;
+		case OP_HANGUP:
+			/* Unless it's a consumer that was replaced */
+			if (data >> 8 == generation && result != -ECANCELED)
+				evchan_close (&mux.chan);
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/* Wait for the writes in progress, handling whatever else completes
+ * meanwhile. The read is not in progress when this is called. */
+static int
+uring_settle ()
+{
+	int res;
+
+	while (batch[0].writing || batch[1].writing) {
+		if (uring_enter (&ring, 1) == -1 && errno != EINTR) {
+			perror ("Error waiting for events");
+			return -1;
+		}
+		if (uring_reap (&res) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Writes of a batch are linked, so that they go in the order they
+ * were read, and submitted along with the next read. The read is not
+ * a part of the chain, so that it does not wait for them. If a write
+ * fails, the ones after it are cancelled, and held back along with it.
+ * An output that has anything held back is written to right away,
+ * with what's held back first. */
+static int
+write_uring (struct batch *b, struct output *out, struct input_event *event, int count)
+{
+	struct io_uring_sqe *sqe;
+
+	/* Out of room: the chain ends with the writes so far. They're
+	 * waited for, so that the next chain starts after them. */
+	if (!uring_room (&ring)) {
+		chain = NULL;
+		if (uring_settle () == -1)
+			return -1;
+	}
+
+	if (out->head != out->tail || out->resync)
+		return output_write (out, event, count);
+
+	/* Linked to the previous write, unless it's submitted already */
+	sqe = uring_get ();
+	if (!sqe)
+		return -1;
+	if (chain)
+		chain->flags |= IOSQE_IO_LINK;
+	chain = sqe;
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = out->fd;
+	sqe->addr = (uintptr_t)event;
+	sqe->len = count * sizeof (struct input_event);
+	sqe->off = -1;
+	sqe->user_data = OP_WRITE | (b - batch) << 8 | (out - mux.output) << 12
+		| (uint64_t)(event - b->event) << 16 | (uint64_t)count << 32;
+	b->writing++;
+
+	return 0;
+}
+
+/* Forward with io_uring: the writes of the frames read are submitted
+ * along with the next read, and waited for along with it, in a single
+ * system call */
+static int
+run_uring ()
+{
+	struct io_uring_sqe *sqe;
+	int reading = 0;	/* Batch read into */
+	int pending = 0;	/* Read submitted */
+	int res;
+
+	if (mux.channel && uring_poll (mux.sock, OP_ACCEPT) == -1)
+		return -1;
+
+	while (!quit) {
+		if (!pending) {
+			sqe = uring_get ();
+			if (!sqe)
+				return -1;
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = mux.input;
+			sqe->addr = (uintptr_t)&batch[reading].event[batch[reading].count];
+			sqe->len = BATCH * sizeof (struct input_event);
+			sqe->off = -1;
+			sqe->user_data = OP_READ;
+			pending = 1;
+		}
+		if (!retrying && output_held ()) {
+			if (uring_retry () == -1)
+				return -1;
+			retrying = 1;
+		}
+
+		/* Anything else that completes meanwhile ends the
+		 * wait early, the rest is waited for again */
+		if (uring_enter (&ring, batch[0].writing + batch[1].writing + 1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror ("Error waiting for events");
+			return -1;
+		}
+
+		switch (uring_reap (&res)) {
+		case -1:
+			return -1;
+		case 0:
+			continue;
+		}
+		pending = 0;
+		if (batch_read (&batch[reading], res) == -1)
+			return -1;
+
+		/* The writes still in progress may not go through, and
+		 * have what's written next held back behind them. The
+		 * other batch gets what's left of this one. */
+		if (uring_settle () == -1)
+			return -1;
+		if (forward (&batch[reading], &batch[!reading], write_uring) == -1)
+			return -1;
+		chain = NULL;
+		reading = !reading;
+
+		if (uring_metrics () == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+	const char *name[OUTPUTS];	/* Of each output, NULL for the channel */
+	int named = 0;
+	char *record = NULL;
+	char *cycle = "70";		/* Scroll Lock */
+	int plain = 0;
+	struct sigaction sa;
+	char *keys;
+	long n;
+	int ret;
+	int opt;
+	int i;
+
+	mux.clock = CLOCK_REALTIME;
+	mux.sock = -1;
+	mux.timer = -1;
+	mux.chan.ring = NULL;
+	mux.chan.conn = mux.chan.wake = -1;
+
+	while ((opt = getopt (argc, argv, "m:R:S:O:k:c:P")) != -1) {
+		switch (opt) {
+		case 'm':
+			mux.metrics = optarg;
+			break;
+		case 'R':
+			record = optarg;
+			break;
+		case 'O':
+		case 'S':
+			if (mux.outputs == OUTPUTS) {
+				fprintf (stderr, "%s: Too many outputs\n", optarg);
+				return 1;
+			}
+			if (opt == 'O') {
+				name[mux.outputs++] = optarg;
+				named++;
+				break;
+			}
+			if (mux.channel) {
+				fprintf (stderr, "%s: Only one event channel is possible\n", optarg);
+				return 1;
+			}
+			mux.channel = optarg;
+			name[mux.outputs++] = NULL;
+			break;
+		case 'k':
+			n = strtol (optarg, &keys, 10);
+			if (keys == optarg || *keys != '=' || n < 1 || n > OUTPUTS
+				|| chord_parse (keys + 1, &hot.chord[n - 1]) == -1) {
+				fprintf (stderr, "%s: Not a valid hotkey\n", optarg);
+				return 1;
+			}
+			break;
+		case 'c':
+			cycle = optarg;
+			break;
+		case 'P':
+			plain = 1;
 			break;
 		default:
-			fprintf (stderr, "Short write forwarding the event.\n");
 			return 1;
 		}
+	}
+
+	if (optind + 1 != argc) {
+		fprintf (stderr, "Usage: %s [-m <file>] [-R <file>] [-O <name>]... [-S <socket>] "
+			"[-k <output>=<keys>]... [-c <keys>] [-P] /dev/input/event<n>\n", argv[0]);
+		return 1;
+	}
 
-		if (event.type == EV_KEY
-			&& event.code == KEY_SCROLLLOCK
-			&& event.value == 0) {
-			switching = 1;
+	/* Unless told otherwise, there's the primary virtual keyboard
+	 * and either the secondary one or the event channel */
+	if (!named) {
+		name[0] = "evmuxd primary";
+		name[1] = mux.channel ? NULL : "evmuxd secondary";
+		mux.outputs = 2;
+	}
+
+	if (chord_parse (cycle, &hot.chord[CHORD_CYCLE]) == -1) {
+		fprintf (stderr, "%s: Not a valid hotkey\n", cycle);
+		return 1;
+	}
+	for (i = mux.outputs; i < OUTPUTS; i++) {
+		if (hot.chord[i]) {
+			fprintf (stderr, "%d: No such output\n", i + 1);
+			return 1;
 		}
-		if (event.type == EV_SYN && switching) {
-			switching = 0;
-			active = !active;
+	}
+	chord_init ();
+
+	mux.input = open_input (argv[optind]);
+	if (mux.input == -1)
+		return 1;
+
+	for (i = 0; i < mux.outputs; i++) {
+		mux.output[i].fd = name[i] ? open_uinput (name[i]) : -1;
+		if (name[i] && mux.output[i].fd == -1)
+			return 1;
+	}
+
+	/* The consumer of the event channel gets the event timestamps
+	 * in the clock it measures the latency with, if possible. */
+	if (mux.channel) {
+		mux.sock = evchan_listen (mux.channel);
+		if (mux.sock == -1)
+			return 1;
+		if (ioctl (mux.input, EVIOCSCLOCKID, &(int){ CLOCK_MONOTONIC }) == -1)
+			perror ("Could not switch the event clock");
+		else
+			mux.clock = CLOCK_MONOTONIC;
+	}
+
+	if (mux.metrics) {
+		write_metrics (mux.metrics);
+		/* Blocking, so that io_uring waits for it to go off */
+		mux.timer = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (mux.timer == -1) {
+			perror ("Could not create a timer");
+			return 1;
 		}
 	}
 
-	return 0;
+	/* Interrupt the wait on termination, so that the recording
+	 * can be finished and the socket removed */
+	if (record && evrec_open (&mux.rec, record) == -1)
+		return 1;
+	if (record || mux.channel) {
+		memset (&sa, 0, sizeof (sa));
+		sa.sa_handler = terminate;
+		sigaction (SIGTERM, &sa, NULL);
+		sigaction (SIGINT, &sa, NULL);
+	}
+
+	/* Older kernels, or ones that don't let us, make do without */
+	if (!plain && uring_init (&ring, RING_ENTRIES) == 0) {
+		ret = run_uring ();
+		uring_exit (&ring);
+	} else {
+		ret = run_plain ();
+	}
+
+	evrec_close (&mux.rec);
+	evchan_close (&mux.chan);
+	if (mux.channel)
+		unlink (mux.channel);
+	return ret == -1;
 }
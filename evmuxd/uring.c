@@ -0,0 +1,135 @@
+/*
+ * Bare io_uring, set up with the system calls themselves
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/* Reading and writing at the current position came along with the
+ * plain read and write operations; losing completions to an overflow
+ * is not something we'd cope with. */
+#define URING_FEATURES	(IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS)
+
+/* Returns -1 if the kernel can't do what we need, errno tells why */
+int
+uring_init (struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	size_t sq, cq;
+	unsigned int *array;
+	unsigned int i;
+
+	memset (&p, 0, sizeof (p));
+	ring->fd = syscall (__NR_io_uring_setup, entries, &p);
+	if (ring->fd == -1)
+		return -1;
+	if ((p.features & URING_FEATURES) != URING_FEATURES) {
+		close (ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	sq = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+	cq = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	ring->size = sq > cq ? sq : cq;
+	ring->rings = mmap (NULL, ring->size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->rings == MAP_FAILED)
+		goto fail;
+	ring->sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		munmap (ring->rings, ring->size);
+		goto fail;
+	}
+
+	ring->entries = p.sq_entries;
+	ring->sq_head = (unsigned int *)(ring->rings + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)(ring->rings + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(ring->rings + p.sq_off.ring_mask);
+	ring->tail = *ring->sq_tail;
+	ring->cq_head = (unsigned int *)(ring->rings + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(ring->rings + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(ring->rings + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(ring->rings + p.cq_off.cqes);
+
+	/* Entries are submitted in the order they're filled in */
+	array = (unsigned int *)(ring->rings + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	return 0;
+fail:
+	close (ring->fd);
+	return -1;
+}
+
+/* A submission entry to fill in, NULL if they're all taken until
+ * the ones filled in so far are submitted */
+struct io_uring_sqe *
+uring_sqe (struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ring->tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries)
+		return NULL;
+
+	sqe = &ring->sqes[ring->tail & *ring->sq_mask];
+	ring->tail++;
+	memset (sqe, 0, sizeof (*sqe));
+	return sqe;
+}
+
+/* Is there a submission entry left to fill in */
+int
+uring_room (struct uring *ring)
+{
+	return ring->tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE) < ring->entries;
+}
+
+/* Submit the entries filled in and wait for given number of completions */
+int
+uring_enter (struct uring *ring, unsigned int wait)
+{
+	unsigned int submit;
+
+	__atomic_store_n (ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+	submit = ring->tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+
+	return syscall (__NR_io_uring_enter, ring->fd, submit, wait,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) == -1 ? -1 : 0;
+}
+
+/* The oldest completion not seen yet, NULL if there's none */
+struct io_uring_cqe *
+uring_cqe (struct uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+/* Done with the completion uring_cqe() returned */
+void
+uring_seen (struct uring *ring)
+{
+	__atomic_store_n (ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void
+uring_exit (struct uring *ring)
+{
+	munmap (ring->sqes, ring->entries * sizeof (struct io_uring_sqe));
+	munmap (ring->rings, ring->size);
+	close (ring->fd);
+}
@@ -0,0 +1,33 @@
+/*
+ * Bare io_uring, set up with the system calls themselves
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#ifndef __URING_H
+#define __URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	char *rings;		/* Submission and completion rings, mapped at once */
+	size_t size;
+	struct io_uring_sqe *sqes;
+	unsigned int entries;
+	unsigned int *sq_head, *sq_tail, *sq_mask;
+	unsigned int tail;	/* Submission entries filled in, up to */
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+int uring_init (struct uring *ring, unsigned int entries);
+struct io_uring_sqe *uring_sqe (struct uring *ring);
+int uring_room (struct uring *ring);
+int uring_enter (struct uring *ring, unsigned int wait);
+struct io_uring_cqe *uring_cqe (struct uring *ring);
+void uring_seen (struct uring *ring);
+void uring_exit (struct uring *ring);
+
+#endif
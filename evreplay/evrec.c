@@ -0,0 +1,148 @@
+/*
+ * Recordings of event device streams
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "evrec.h"
+
+/* Recordings are written through a big buffer, so that a record
+ * is just a copy most of the time */
+#define EVREC_BUFFER	(64 * 1024)
+
+int
+evrec_open (struct evrec *rec, const char *file)
+{
+	struct evrec_header header;
+
+	rec->f = fopen (file, "w");
+	if (rec->f == NULL) {
+		perror (file);
+		return -1;
+	}
+	setvbuf (rec->f, NULL, _IOFBF, EVREC_BUFFER);
+	rec->last = -1;
+
+	/* The start is filled in with the first event */
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, EVREC_MAGIC, sizeof (header.magic));
+	header.version = EVREC_VERSION;
+	header.size = sizeof (struct evrec_record);
+	if (fwrite (&header, sizeof (header), 1, rec->f) != 1) {
+		perror (file);
+		fclose (rec->f);
+		rec->f = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Append events to the recording */
+void
+evrec_write (struct evrec *rec, const struct input_event *event, int count)
+{
+	struct evrec_record record;
+	long long stamp, delta;
+	int i;
+
+	if (rec->f == NULL)
+		return;
+
+	for (i = 0; i < count; i++) {
+		stamp = event[i].input_event_sec * 1000000LL + event[i].input_event_usec;
+		if (rec->last == -1) {
+			/* Right after the header */
+			fseek (rec->f, offsetof (struct evrec_header, start), SEEK_SET);
+			fwrite (&(uint64_t){ stamp }, sizeof (uint64_t), 1, rec->f);
+			fseek (rec->f, 0, SEEK_END);
+			rec->last = stamp;
+		}
+
+		/* Clock steps and pauses over an hour are not preserved */
+		delta = stamp - rec->last;
+		if (delta < 0)
+			delta = 0;
+		if (delta > UINT32_MAX)
+			delta = UINT32_MAX;
+		rec->last = stamp;
+
+		record.delta = delta;
+		record.type = event[i].type;
+		record.code = event[i].code;
+		record.value = event[i].value;
+		if (fwrite (&record, sizeof (record), 1, rec->f) != 1) {
+			perror ("Could not record an event");
+			fclose (rec->f);
+			rec->f = NULL;
+			return;
+		}
+	}
+}
+
+void
+evrec_close (struct evrec *rec)
+{
+	if (rec->f == NULL)
+		return;
+	if (fclose (rec->f) != 0)
+		perror ("Could not finish the recording");
+	rec->f = NULL;
+}
+
+/* Map a recording. Returns the records and their count via n. */
+const struct evrec_record *
+evrec_map (const char *file, size_t *n)
+{
+	const struct evrec_header *header;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open (file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror (file);
+		return NULL;
+	}
+	if (fstat (fd, &st) == -1) {
+		perror (file);
+		close (fd);
+		return NULL;
+	}
+	if (st.st_size < sizeof (*header)) {
+		fprintf (stderr, "%s: Not a recording.\n", file);
+		close (fd);
+		return NULL;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		perror (file);
+		return NULL;
+	}
+
+	header = map;
+	if (memcmp (header->magic, EVREC_MAGIC, sizeof (header->magic)) != 0
+		|| header->version != EVREC_VERSION
+		|| header->size != sizeof (struct evrec_record)) {
+		fprintf (stderr, "%s: Not a recording, or a different version.\n", file);
+		munmap (map, st.st_size);
+		return NULL;
+	}
+
+	/* It is read from the start to the end, once */
+	madvise (map, st.st_size, MADV_SEQUENTIAL);
+
+	*n = (st.st_size - sizeof (*header)) / sizeof (struct evrec_record);
+	return (const struct evrec_record *)(header + 1);
+}
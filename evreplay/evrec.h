@@ -0,0 +1,47 @@
+/*
+ * Recordings of event device streams
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#ifndef __EVREC_H
+#define __EVREC_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <linux/input.h>
+
+/* The file starts with a header, followed by fixed-size records,
+ * so that it can be mapped and walked through as an array. All
+ * numbers are in the host byte order. */
+#define EVREC_MAGIC	"EVRC"
+#define EVREC_VERSION	1
+
+struct evrec_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t size;		/* Of a record */
+	uint64_t start;		/* Timestamp of the first event, in us */
+};
+
+/* An event, half the size of struct input_event */
+struct evrec_record {
+	uint32_t delta;		/* Since the previous event, in us */
+	uint16_t type;
+	uint16_t code;
+	int32_t value;
+};
+
+/* A recording being written */
+struct evrec {
+	FILE *f;
+	long long last;		/* Timestamp of the last event, in us */
+};
+
+int evrec_open (struct evrec *rec, const char *file);
+void evrec_write (struct evrec *rec, const struct input_event *event, int count);
+void evrec_close (struct evrec *rec);
+
+const struct evrec_record *evrec_map (const char *file, size_t *n);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * Replay a recording of an event device into a virtual keyboard
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+
+#include "evrec.h"
+
+#define UINPUT "/dev/uinput"
+
+/* Events written at once, at most */
+#define BATCH 64
+
+static int
+open_uinput (const char *name)
+{
+	struct uinput_user_dev dev = { 0, };
+	int fd;
+	int i;
+
+	fd = open (UINPUT, O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror (UINPUT);
+		return -1;
+	}
+
+	if (ioctl (fd, UI_SET_EVBIT, EV_KEY) == -1) {
+		perror ("Could not enable key events");
+		goto fail;
+	}
+
+	for (i = 0; i < KEY_CNT; i++) {
+		if (ioctl (fd, UI_SET_KEYBIT, i) == -1) {
+			perror ("Could not enable a key event");
+			goto fail;
+		}
+	}
+
+	/* Scan codes go along with the keys */
+	if (ioctl (fd, UI_SET_EVBIT, EV_MSC) == -1
+		|| ioctl (fd, UI_SET_MSCBIT, MSC_SCAN) == -1) {
+		perror ("Could not enable scan code events");
+		goto fail;
+	}
+
+	/* Repeats are in the recording, if there were any. Having the
+	 * kernel generate them as well would be wrong. */
+
+	strncpy (dev.name, name, UINPUT_MAX_NAME_SIZE - 1);
+	dev.id.bustype = BUS_VIRTUAL;
+	dev.id.vendor  = 0x0666;
+	dev.id.product = 0x8088;
+	dev.id.version = 1;
+
+	if (write (fd, &dev, sizeof (dev)) != sizeof (dev)) {
+		perror (UINPUT);
+		goto fail;
+	}
+
+	if (ioctl (fd, UI_DEV_CREATE) == -1) {
+		perror ("Could not create the virtual keyboard");
+		goto fail;
+	}
+
+	return fd;
+fail:
+	close (fd);
+	return -1;
+}
+
+static int
+flush (int fd, struct input_event *event, int count)
+{
+	if (count && write (fd, event, count * sizeof (*event)) != count * sizeof (*event)) {
+		perror ("Could not replay the events");
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+	const struct evrec_record *rec;
+	struct input_event event[BATCH];
+	struct timespec ts;
+	const char *name = "evreplay";
+	long long when, start, end;
+	int fast = 0, wait = 1000;
+	int uinput;
+	size_t n, i;
+	int count = 0;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "fn:w:")) != -1) {
+		switch (opt) {
+		case 'f':
+			fast = 1;
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 'w':
+			wait = atoi (optarg);
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	if (optind + 1 != argc) {
+		fprintf (stderr, "Usage: %s [-f] [-n <name>] [-w <ms>] <recording>\n", argv[0]);
+		return 1;
+	}
+
+	rec = evrec_map (argv[optind], &n);
+	if (rec == NULL)
+		return 1;
+
+	uinput = open_uinput (name);
+	if (uinput == -1)
+		return 1;
+
+	/* Give whoever is interested the time to open the device */
+	usleep (wait * 1000);
+
+	memset (event, 0, sizeof (event));
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	start = when = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+
+	for (i = 0; i < n; i++) {
+		/* Wait for the time the event is due. Events of a frame
+		 * come at once and are written together. */
+		if (!fast && rec[i].delta) {
+			if (flush (uinput, event, count) == -1)
+				return 1;
+			count = 0;
+			when += rec[i].delta;
+			ts.tv_sec = when / 1000000;
+			ts.tv_nsec = when % 1000000 * 1000;
+			while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		}
+
+		event[count].type = rec[i].type;
+		event[count].code = rec[i].code;
+		event[count].value = rec[i].value;
+		count++;
+
+		/* In the fast mode, each frame is written at once,
+		 * so that the readers don't see it half done */
+		if (count == BATCH || (fast && rec[i].type == EV_SYN)) {
+			if (flush (uinput, event, count) == -1)
+				return 1;
+			count = 0;
+		}
+	}
+	if (flush (uinput, event, count) == -1)
+		return 1;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	end = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+	fprintf (stderr, "%zu events replayed in %.3f s.\n", n, (end - start) / 1e6);
+
+	/* Let the readers see the last events before the device goes away */
+	usleep (wait * 1000);
+	ioctl (uinput, UI_DEV_DESTROY);
+	close (uinput);
+
+	return 0;
+}